@@ -19,6 +19,8 @@
 #ifndef __IPMMUI_H__
 #define __IPMMUI_H__
 
+#include <meram/meram.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -54,6 +56,8 @@ IPMMUI *ipmmui_open(void);
 
 /**
   * Close a IPMMUI handle
+  * Mappings made by ipmmui_map through the handle are removed and the
+  * PMBs it still holds are released.
   * \param ipmmui IPMMUI handle
   */
 void ipmmui_close(IPMMUI *ipmmui);
@@ -61,10 +65,13 @@ void ipmmui_close(IPMMUI *ipmmui);
 /**
   * Lock access to a IPMMUI PMB registers
   * The application should hold this lock for as long as it will use
-  * the specified PMB.
+  * the specified PMB. A PMB can only be locked by one user at a time,
+  * across all processes. ipmmui_map takes its PMBs from the highest
+  * index down, so fixed indices should be chosen from 0 up.
   * \param ipmmui IPMMUI handle
   * \param index index of the PMB to lock
-  * \retval 0 Failure, otherwise handle to the locked PMB
+  * \retval 0 Failure (invalid index or PMB in use), otherwise handle to
+  *           the locked PMB
   */
 PMB *ipmmui_lock_pmb(IPMMUI *ipmmui, int index);
 
@@ -77,6 +84,28 @@ PMB *ipmmui_lock_pmb(IPMMUI *ipmmui, int index);
   */
 void ipmmui_unlock_pmb(IPMMUI *ipmmui, PMB *pmb);
 
+/**
+  * Map a physical buffer through a free PMB
+  * The free PMB with the highest index is claimed, leaving the low
+  * indices to users of ipmmui_lock_pmb. A virtual address window of the
+  * smallest PMB page size (16, 64, 128 or 512 MiB) that covers the
+  * buffer is found in the IPMMUI address space, and IMPMBA/IMPMBD are
+  * programmed. The window does not overlap windows of other PMBs or the
+  * ones listed in meram.conf.
+  * \param ipmmui IPMMUI handle
+  * \param paddr physical address of the buffer
+  * \param size size of the buffer in bytes
+  * \param vaddr address to store the IPMMUI virtual address of paddr
+  * \retval 0 Failure, otherwise handle to the PMB used for the mapping
+  */
+PMB *ipmmui_map(IPMMUI *ipmmui, unsigned long paddr, unsigned long size,
+		unsigned long *vaddr);
+/**
+  * Remove a mapping made by ipmmui_map and release its PMB
+  * \param ipmmui IPMMUI handle
+  * \param pmb PMB handle returned by ipmmui_map
+  */
+void ipmmui_unmap(IPMMUI *ipmmui, PMB *pmb);
 /**
   * Lock access to IPMMUI common registers
   * The application should only hold this lock when accessing the registers
@@ -94,13 +123,45 @@ IPMMUI_REG *ipmmui_lock_reg(IPMMUI *ipmmui);
   */
 void ipmmui_unlock_reg(IPMMUI *ipmmui, IPMMUI_REG *ipmmui_reg);
 
+/**
+  * Update some bits of an IPMMUI common register under a single lock
+  * \param ipmmui IPMMUI handle
+  * \param offset register offset (e.g. IMCTR1)
+  * \param mask bits to modify
+  * \param val new value of the bits in mask
+  * \retval -1 Failure
+  * 	     0 Success
+  */
+int ipmmui_update_reg(IPMMUI *ipmmui, int offset, unsigned long mask,
+		unsigned long val);
+
+/**
+  * Set bits in an IPMMUI common register, see ipmmui_update_reg
+  * \param ipmmui IPMMUI handle
+  * \param offset register offset
+  * \param bits bits to set
+  * \retval -1 Failure
+  * 	     0 Success
+  */
+int ipmmui_set_reg_bits(IPMMUI *ipmmui, int offset, unsigned long bits);
+
+/**
+  * Clear bits in an IPMMUI common register, see ipmmui_update_reg
+  * \param ipmmui IPMMUI handle
+  * \param offset register offset
+  * \param bits bits to clear
+  * \retval -1 Failure
+  * 	     0 Success
+  */
+int ipmmui_clear_reg_bits(IPMMUI *ipmmui, int offset, unsigned long bits);
+
 /**
   * Read data from IPMMUI PMB register
   * \param ipmmui IPMMUI handle
   * \param pmb handle to PMB
-  * \param offset address offset within PMB register block
+  * \param offset IMPMBA or IMPMBD
   * \param read_val pointer to store read result data
-  * \retval -1 Failure
+  * \retval -1 Failure (invalid offset)
   * 	     0 Success
   */
 int ipmmui_read_pmb(IPMMUI *ipmmui, PMB *pmb, int offset,
@@ -110,9 +171,9 @@ int ipmmui_read_pmb(IPMMUI *ipmmui, PMB *pmb, int offset,
   * Write data to IPMMUI PMB register
   * \param ipmmui IPMMUI handle
   * \param pmb handle to PMB
-  * \param offset address offset within PMB register block
+  * \param offset IMPMBA or IMPMBD
   * \param val data to write
-  * \retval -1 Failure
+  * \retval -1 Failure (invalid offset)
   * 	     0 Success
   */
 int ipmmui_write_pmb(IPMMUI *ipmmui, PMB *pmb, int offset, unsigned long val);
@@ -141,6 +202,56 @@ int ipmmui_read_reg(IPMMUI *ipmmui, IPMMUI_REG *ipmmui_reg, int offset,
 int ipmmui_write_reg(IPMMUI *ipmmui, IPMMUI_REG *ipmmui_reg, int offset,
 		unsigned long val);
 
+/**
+  * Write several IPMMUI PMB registers in one call
+  * Only the IMPMBA and IMPMBD offsets of the PMB may be used.
+  * \param ipmmui IPMMUI handle
+  * \param pmb handle to PMB
+  * \param ops array of register accesses, see meram_write_icb_batch
+  * \param n number of entries in ops
+  * \retval -1 Failure (no register has been written)
+  * 	     0 Success
+  */
+int ipmmui_write_pmb_batch(IPMMUI *ipmmui, PMB *pmb,
+		const struct meram_reg_op *ops, int n);
+
+/**
+  * Read several IPMMUI PMB registers in one call
+  * Only the IMPMBA and IMPMBD offsets of the PMB may be used.
+  * \param ipmmui IPMMUI handle
+  * \param pmb handle to PMB
+  * \param ops array of register accesses, see meram_read_icb_batch
+  * \param n number of entries in ops
+  * \retval -1 Failure
+  * 	     0 Success
+  */
+int ipmmui_read_pmb_batch(IPMMUI *ipmmui, PMB *pmb,
+		struct meram_reg_op *ops, int n);
+
+/**
+  * Write several IPMMUI common registers in one call
+  * \param ipmmui IPMMUI handle
+  * \param ipmmui_reg handle to common registers
+  * \param ops array of register accesses, see meram_write_icb_batch
+  * \param n number of entries in ops
+  * \retval -1 Failure (no register has been written)
+  * 	     0 Success
+  */
+int ipmmui_write_reg_batch(IPMMUI *ipmmui, IPMMUI_REG *ipmmui_reg,
+		const struct meram_reg_op *ops, int n);
+
+/**
+  * Read several IPMMUI common registers in one call
+  * \param ipmmui IPMMUI handle
+  * \param ipmmui_reg handle to common registers
+  * \param ops array of register accesses, see meram_read_icb_batch
+  * \param n number of entries in ops
+  * \retval -1 Failure
+  * 	     0 Success
+  */
+int ipmmui_read_reg_batch(IPMMUI *ipmmui, IPMMUI_REG *ipmmui_reg,
+		struct meram_reg_op *ops, int n);
+
 /**
   * Get the virutal address used to access a specific PMB
   * \param ipmmui IPMMUI handle
@@ -155,6 +266,26 @@ ipmmui_get_vaddr(IPMMUI *ipmmui,
 		 const char *tag,
 		 unsigned long *vaddr,
 		 int *size);
+/**
+  * Get a handle for a tag, so that its settings can be looked up
+  * without hashing the tag string again. Handles stay valid for the
+  * life of the process.
+  * \param ipmmui IPMMUI handle
+  * \param tag tag string indicating the application using the PMB
+  * \retval -1 invalid IPMMUI handle or tag, otherwise the tag handle
+  */
+int ipmmui_get_tag(IPMMUI *ipmmui, const char *tag);
+/**
+  * Get the virtual address used to access a specific PMB by tag handle
+  * \param ipmmui IPMMUI handle
+  * \param tag tag handle returned by ipmmui_get_tag
+  * \param vaddr address to store the vaddr to access
+  * \param size size of virtual address space (in MiB)
+  * \retval -1 invalid IPMMUI handle or tag handle
+  *          0 Success
+  */
+int ipmmui_get_tag_vaddr(IPMMUI *ipmmui, int tag, unsigned long *vaddr,
+			 int *size);
 #ifdef __cplusplus
 }
 #endif
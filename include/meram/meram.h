@@ -19,6 +19,9 @@
 #ifndef __MERAM_H__
 #define __MERAM_H__
 
+#include <stddef.h>
+#include <time.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -31,6 +34,33 @@ extern "C" {
 #define MExxSBSIZE	0x18
 #define MSAR_OFF	0x3C0
 
+/* MExxCTRL fields */
+#define MExxCTRL_BV		(1UL << 31)
+#define MExxCTRL_MSAR_SHIFT	16
+#define MExxCTRL_MSAR_MASK	(0x7ff << MExxCTRL_MSAR_SHIFT)
+#define MExxCTRL_NXT_SHIFT	11
+#define MExxCTRL_NXT_MASK	(0x1f << MExxCTRL_NXT_SHIFT)
+#define MExxCTRL_WD1		(1 << 10)
+#define MExxCTRL_WD0		(1 << 9)
+#define MExxCTRL_WS		(1 << 8)
+#define MExxCTRL_CB		(1 << 7)
+#define MExxCTRL_WBF		(1 << 6)
+#define MExxCTRL_WF		(1 << 5)
+#define MExxCTRL_RF		(1 << 4)
+#define MExxCTRL_CM		(1 << 3)
+#define MExxCTRL_MD_READ	(1 << 0)
+#define MExxCTRL_MD_WRITE	(2 << 0)
+#define MExxCTRL_MD_MASK	(7 << 0)
+
+/* MExxBSIZE fields */
+#define MExxBSIZE_RCNT_SHIFT	28
+#define MExxBSIZE_YSZM1_SHIFT	16
+#define MExxBSIZE_XSZM1_SHIFT	0
+
+/* MExxMCNF fields */
+#define MExxMCNF_BNM_SHIFT	16
+#define MExxMCNF_BNM_MASK	(0xff << MExxMCNF_BNM_SHIFT)
+
 #define MEVCR1		0x4
 #define MEACTS		0x10
 #define MEQSEL1		0x40
@@ -56,6 +86,139 @@ typedef struct ICB ICB;
 struct MERAM_REG;
 typedef struct MERAM_REG MERAM_REG;
 
+struct MERAM_JOB;
+typedef struct MERAM_JOB MERAM_JOB;
+
+struct MERAM_ARENA;
+typedef struct MERAM_ARENA MERAM_ARENA;
+
+/**
+  * One register access of a batch, see meram_write_icb_batch
+  */
+struct meram_reg_op {
+	int offset;		/**< register offset within the register block */
+	unsigned long mask;	/**< bits to modify, 0 to access all bits */
+	unsigned long val;	/**< value to write, or the value read */
+};
+
+/**
+  * Pixel formats of the plane cached by an ICB
+  */
+enum meram_pixel_format {
+	MERAM_PF_Y8,		/**< 8 bit luma plane (NV12/NV16/YUV420) */
+	MERAM_PF_CBCR420,	/**< interleaved CbCr plane of NV12 */
+	MERAM_PF_CBCR422,	/**< interleaved CbCr plane of NV16 */
+	MERAM_PF_RGB565,	/**< 16 bit RGB */
+	MERAM_PF_RGB888,	/**< 24 bit RGB */
+	MERAM_PF_RGBX8888,	/**< 32 bit RGB */
+};
+
+/**
+  * Direction of the data transfer through an ICB
+  */
+enum meram_icb_mode {
+	MERAM_ICB_READ,		/**< read-ahead from system memory */
+	MERAM_ICB_WRITE,	/**< write-back to system memory */
+};
+
+#define MERAM_STATS_MAX_RESERVED	16
+
+/**
+  * Snapshot of the MERAM allocation state, see meram_get_stats
+  * Sizes are in 1K blocks. Counters are cumulative over all processes
+  * since the allocation state was created.
+  */
+struct meram_stats {
+	int total_blocks;	/**< blocks managed by the allocator */
+	int free_blocks;	/**< blocks not allocated or reserved */
+	int largest_free;	/**< longest run of free blocks */
+	int max_alloc;		/**< largest size meram_alloc_memory_block
+				     can currently satisfy */
+	int free_extents;	/**< number of runs of free blocks */
+	int reserved_blocks;	/**< blocks reserved in meram.conf */
+	int n_reserved;		/**< number of entries in reserved */
+	struct {
+		int start_block;
+		int end_block;	/**< last block, inclusive */
+	} reserved[MERAM_STATS_MAX_RESERVED];	/**< reserved ranges */
+	int icb_owner[MAX_ICB_INDEX + 1];	/**< pid owning each ICB,
+						     0 if free */
+	unsigned long allocs;		/**< successful allocations */
+	unsigned long frees;		/**< freed extents */
+	unsigned long failures;		/**< failed allocations */
+	unsigned long alloc_ns_total;	/**< time spent allocating */
+	unsigned long alloc_ns_max;	/**< slowest allocation */
+};
+
+/* range of the MERAM line pitch, a power of two, see meram_calc_layout */
+#define MERAM_PITCH_MIN		1024
+#define MERAM_PITCH_MAX		8192
+#define MERAM_MAX_PLANES	2
+
+/**
+  * Description of the plane cached by an ICB, see meram_configure_icb
+  */
+struct meram_icb_config {
+	int width;		/**< width of the plane in pixels */
+	int height;		/**< height of the image in lines */
+	int stride;		/**< line stride in system memory in bytes,
+				     0 if lines are packed */
+	int format;		/**< one of enum meram_pixel_format */
+	int lines;		/**< number of lines to cache in MERAM */
+	int mode;		/**< one of enum meram_icb_mode */
+	unsigned long ssara;	/**< system memory address of bank A */
+	unsigned long ssarb;	/**< system memory address of bank B,
+				     0 if not used */
+};
+
+/**
+  * MERAM placement and register values of one plane, see meram_calc_layout
+  */
+struct meram_plane_layout {
+	int pitch;		/**< bytes per line in MERAM */
+	int block;		/**< first block, relative to the image */
+	int size;		/**< size in 1K blocks */
+	unsigned long ctrl;	/**< MExxCTRL, MSAR relative to the image */
+	unsigned long bsize;	/**< MExxBSIZE */
+	unsigned long mcnf;	/**< MExxMCNF */
+	unsigned long sbsize;	/**< MExxSBSIZE */
+};
+
+/**
+  * MERAM layout of an image made of one or more planes
+  */
+struct meram_layout {
+	int n_planes;		/**< number of entries in plane */
+	int size;		/**< size of the whole image in 1K blocks */
+	struct meram_plane_layout plane[MERAM_MAX_PLANES];
+};
+
+/**
+  * A stream to plan for with meram_plan
+  * The input fields describe the planes of the stream; the lines field
+  * of the plane descriptions is ignored. The output fields are filled in
+  * by meram_plan, the input fields are left as they are.
+  */
+struct meram_plan_stream {
+	int n_planes;		/**< number of planes (e.g. 2 for NV12) */
+	struct meram_icb_config planes[MERAM_MAX_PLANES];
+				/**< description of each plane */
+	int priority;		/**< higher priorities get lines first */
+	int min_lines;		/**< lines the stream needs, 0 for 1 */
+	int max_lines;		/**< lines the stream can use, 0 for 256 */
+	int lines;		/**< out: planned lines (luma) */
+	int icb[MERAM_MAX_PLANES];	/**< out: ICB index of each plane */
+	int block;		/**< out: planned first block */
+	struct meram_layout layout;	/**< out: layout of the planes */
+};
+
+/**
+  * Called by meram_apply_icb_policy after the number of lines cached by
+  * an ICB has been changed, and its further planes may have moved
+  */
+typedef void (*meram_shrink_cb)(MERAM *meram, ICB *icb, int lines,
+				void *arg);
+
 /**
   * Open a handle to MERAM
   * \retval 0 Failure, otherwise MERAM handle
@@ -64,6 +227,8 @@ MERAM *meram_open(void);
 
 /**
   * Close a MERAM handle
+  * MERAM memory blocks still allocated through the handle are freed and
+  * its remaining arenas are destroyed.
   * \param meram MERAM handle
   */
 void meram_close(MERAM *meram);
@@ -88,6 +253,42 @@ ICB *meram_lock_icb(MERAM *meram, int index);
   */
 ICB *meram_trylock_icb(MERAM *meram, int index);
 
+/**
+  * Lock access to a MERAM ICB registers, waiting no later than a deadline.
+  * Real-time callers can use this to fall back to a path without MERAM
+  * when an ICB does not become free within their frame budget.
+  * \param meram MERAM handle
+  * \param index index of the ICB to lock
+  * \param deadline absolute CLOCK_MONOTONIC time to give up at, must not
+  *        be NULL (use meram_lock_icb to wait without a deadline)
+  * \retval 0 Failure, otherwise handle to the locked ICB. errno is set
+  *         to ETIMEDOUT if the deadline passed before the ICB was free,
+  *         or to EINVAL if deadline is NULL.
+  */
+ICB *meram_timedlock_icb(MERAM *meram, int index,
+	const struct timespec *deadline);
+
+/**
+  * Lock access to the first free MERAM ICB within a range of indices.
+  * The ICB is claimed atomically, so callers need not loop over
+  * meram_trylock_icb to find a free one.
+  * \param meram MERAM handle
+  * \param lo lowest index to consider (e.g. 32 for the extended ICBs)
+  * \param hi highest index to consider (up to MAX_ICB_INDEX)
+  * \param timeout_ms time to wait for an ICB to become free in ms,
+  *        0 to return immediately, negative to wait forever
+  * \retval 0 Failure, otherwise handle to the locked ICB. errno is set
+  *         to ETIMEDOUT if the timeout expired.
+  */
+ICB *meram_lock_any_icb(MERAM *meram, int lo, int hi, int timeout_ms);
+
+/**
+  * Get the index of a locked ICB, e.g. one locked with meram_lock_any_icb
+  * \param icb ICB handle
+  * \retval -1 Failure, otherwise the ICB index
+  */
+int meram_get_icb_index(ICB *icb);
+
 /**
   * Unlock a MERAM ICB registers when no longer needed
   * The application should unlock the ICB only after is has finished
@@ -114,6 +315,41 @@ MERAM_REG *meram_lock_reg(MERAM *meram);
   */
 void meram_unlock_reg(MERAM *meram, MERAM_REG *meram_reg);
 
+/**
+  * Update some bits of a MERAM common register
+  * The common registers are locked, the register is read, the bits in
+  * mask are replaced with those of val and the result is written back
+  * before the lock is dropped again.
+  * \param meram MERAM handle
+  * \param offset register offset (e.g. MEVCR1, MEQSEL1)
+  * \param mask bits to modify
+  * \param val new value of the bits in mask
+  * \retval -1 Failure
+  * 	     0 Success
+  */
+int meram_update_reg(MERAM *meram, int offset, unsigned long mask,
+		unsigned long val);
+
+/**
+  * Set bits in a MERAM common register, see meram_update_reg
+  * \param meram MERAM handle
+  * \param offset register offset
+  * \param bits bits to set
+  * \retval -1 Failure
+  * 	     0 Success
+  */
+int meram_set_reg_bits(MERAM *meram, int offset, unsigned long bits);
+
+/**
+  * Clear bits in a MERAM common register, see meram_update_reg
+  * \param meram MERAM handle
+  * \param offset register offset
+  * \param bits bits to clear
+  * \retval -1 Failure
+  * 	     0 Success
+  */
+int meram_clear_reg_bits(MERAM *meram, int offset, unsigned long bits);
+
 /** Allocate MERAM memory blocks and associate with an ICB
   * The library will keep track of which memory has been allocated
   * and can be free with meram_free_icb_meram
@@ -166,6 +402,49 @@ void meram_unlock_memory_block(MERAM *meram, int offset, int size);
   */
 int meram_alloc_memory_block(MERAM *meram, int size);
 
+/**
+  * Create an arena of MERAM memory blocks for short lived allocations
+  * The blocks are allocated as one extent owned by the MERAM handle.
+  * \param meram MERAM handle
+  * \param size size of the arena in 1K units
+  * \retval 0 Failure, otherwise arena handle
+  */
+MERAM_ARENA *meram_arena_create(MERAM *meram, int size);
+
+/**
+  * Allocate blocks from an arena
+  * The blocks are given back by meram_arena_reset, they must not be
+  * freed with meram_free_memory_block.
+  * \param arena arena handle
+  * \param size size of block to allocate in 1K units
+  * \retval -1 Failure (arena full), otherwise offset of allocated block
+  */
+int meram_arena_alloc(MERAM_ARENA *arena, int size);
+
+/**
+  * Give back all allocations of an arena at once
+  * \param arena arena handle
+  */
+void meram_arena_reset(MERAM_ARENA *arena);
+
+/**
+  * Destroy an arena and free its blocks
+  * Arenas still open are destroyed by meram_close, so this must not be
+  * called after the MERAM handle of the arena has been closed.
+  * \param arena arena handle
+  */
+void meram_arena_destroy(MERAM_ARENA *arena);
+
+/**
+  * Allocate MERAM internal memory blocks cleared to zero
+  * Blocks are not cleared when they are freed; the clearing is done
+  * here, for the callers that need it.
+  * \param meram MERAM handle
+  * \param size size of block to allocate in 1K units (e.g. 4 = 4K)
+  * \retval -1 Failure, otherwise offset of allocated block
+  */
+int meram_alloc_memory_block_zeroed(MERAM *meram, int size);
+
 /**
   * Free MERAM internal memory
   * \param meram MERAM handle
@@ -175,7 +454,32 @@ int meram_alloc_memory_block(MERAM *meram, int size);
 void meram_free_memory_block(MERAM *meram, int offset, int size);
 
 /**
-  * Fill MERAM internal memory with a value
+  * Compact the MERAM memory of a set of ICBs
+  * The memory of each ICB allocated with meram_alloc_icb_memory (or
+  * meram_configure_icb) is moved to the lowest free place below it,
+  * its contents are copied and MExxCTRL.MSAR is updated to match. The
+  * memory stays owned by the MERAM handle it was allocated through. The
+  * ICBs must be locked by the caller and idle, i.e. the hardware must
+  * not access them during the call.
+  * \param meram MERAM handle
+  * \param icbs locked ICB handles
+  * \param n number of entries in icbs
+  * \retval -1 Failure (including old memory that could not be freed),
+  *            otherwise the number of ICBs moved
+  */
+int meram_compact_icbs(MERAM *meram, ICB **icbs, int n);
+
+/**
+  * Get a snapshot of the MERAM allocation state
+  * \param meram MERAM handle
+  * \param stats structure to fill in
+  * \retval -1 Failure
+  * 	     0 Success
+  */
+int meram_get_stats(MERAM *meram, struct meram_stats *stats);
+
+/**
+  * Fill MERAM internal memory with a 32 bit value
   * \param meram MERAM handle
   * \param offset offset of the allocated block
   * \param n_blocks number of blocks to allocate in 1K units (e.g. 4 = 4K)
@@ -183,6 +487,101 @@ void meram_free_memory_block(MERAM *meram, int offset, int size);
   */
 void meram_fill_memory_block(MERAM *meram, int offset, int n_blocks, unsigned int value);
 
+/**
+  * Fill MERAM internal memory with a repeated pattern
+  * The pattern is stored in native byte order, e.g. 0x80 with bits = 8
+  * gives a neutral chroma plane and 0x80008000 with bits = 32 a black
+  * UYVY image.
+  * \param meram MERAM handle
+  * \param offset offset of the allocated block
+  * \param n_blocks number of blocks to fill in 1K units
+  * \param pattern pattern to fill with
+  * \param bits width of the pattern: 8, 16, 32 or 64
+  * \retval -1 Failure
+  * 	     0 Success
+  */
+int meram_fill_memory_pattern(MERAM *meram, int offset, int n_blocks,
+			      unsigned long long pattern, int bits);
+
+/**
+  * Copy data from system memory into MERAM internal memory
+  * \param meram MERAM handle
+  * \param offset offset of the allocated block
+  * \param src data to copy
+  * \param bytes number of bytes to copy
+  * \retval -1 Failure
+  * 	     0 Success
+  */
+int meram_copy_to_memory_block(MERAM *meram, int offset, const void *src,
+			       size_t bytes);
+
+/**
+  * Copy data from MERAM internal memory to system memory
+  * \param meram MERAM handle
+  * \param offset offset of the allocated block
+  * \param dst buffer to copy to
+  * \param bytes number of bytes to copy
+  * \retval -1 Failure
+  * 	     0 Success
+  */
+int meram_copy_from_memory_block(MERAM *meram, int offset, void *dst,
+				 size_t bytes);
+
+/**
+  * Queue a meram_fill_memory_pattern on the library's worker thread
+  * Jobs are run in the order they are queued. The blocks must stay
+  * allocated until the job has finished.
+  * \param meram MERAM handle
+  * \param offset offset of the allocated block
+  * \param n_blocks number of blocks to fill in 1K units
+  * \param pattern pattern to fill with
+  * \param bits width of the pattern: 8, 16, 32 or 64
+  * \retval 0 Failure, otherwise job handle to pass to meram_job_wait
+  */
+MERAM_JOB *meram_fill_memory_async(MERAM *meram, int offset, int n_blocks,
+				   unsigned long long pattern, int bits);
+
+/**
+  * Queue a meram_copy_to_memory_block on the library's worker thread
+  * \param meram MERAM handle
+  * \param offset offset of the allocated block
+  * \param src data to copy, must stay valid until the job has finished
+  * \param bytes number of bytes to copy
+  * \retval 0 Failure, otherwise job handle to pass to meram_job_wait
+  */
+MERAM_JOB *meram_copy_to_memory_async(MERAM *meram, int offset,
+				      const void *src, size_t bytes);
+
+/**
+  * Queue a meram_copy_from_memory_block on the library's worker thread
+  * \param meram MERAM handle
+  * \param offset offset of the allocated block
+  * \param dst buffer to copy to
+  * \param bytes number of bytes to copy
+  * \retval 0 Failure, otherwise job handle to pass to meram_job_wait
+  */
+MERAM_JOB *meram_copy_from_memory_async(MERAM *meram, int offset,
+					void *dst, size_t bytes);
+
+/**
+  * Check whether a background job has finished
+  * \param job job handle
+  * \retval -1 Failure
+  * 	     0 Job still pending
+  * 	     1 Job finished, meram_job_wait will not block
+  */
+int meram_job_poll(MERAM_JOB *job);
+
+/**
+  * Wait for a background job to finish and release it
+  * Every job must be released with this function, also after
+  * meram_job_poll has reported it finished.
+  * \param job job handle
+  * \retval -1 Failure of the job
+  * 	     0 Success
+  */
+int meram_job_wait(MERAM_JOB *job);
+
 /**
   * Read data from MERAM ICB register
   * \param meram MERAM handle
@@ -230,6 +629,82 @@ int meram_read_reg(MERAM *meram, MERAM_REG *meram_reg, int offset,
 int meram_write_reg(MERAM *meram, MERAM_REG *meram_reg, int offset,
 		unsigned long val);
 
+/**
+  * Write several MERAM ICB registers in one call
+  * All offsets are validated before any register is written and the
+  * writes are issued in array order. Entries with a non-zero mask only
+  * modify the masked bits (read-modify-write).
+  * \param meram MERAM handle
+  * \param icb handle to ICB
+  * \param ops array of register accesses
+  * \param n number of entries in ops
+  * \retval -1 Failure (no register has been written)
+  * 	     0 Success
+  */
+int meram_write_icb_batch(MERAM *meram, ICB *icb,
+		const struct meram_reg_op *ops, int n);
+
+/**
+  * Read several MERAM ICB registers in one call
+  * \param meram MERAM handle
+  * \param icb handle to ICB
+  * \param ops array of register accesses, val receives the (masked)
+  *            register value
+  * \param n number of entries in ops
+  * \retval -1 Failure
+  * 	     0 Success
+  */
+int meram_read_icb_batch(MERAM *meram, ICB *icb,
+		struct meram_reg_op *ops, int n);
+
+/**
+  * Write several MERAM common registers in one call
+  * \param meram MERAM handle
+  * \param meram_reg handle to common registers
+  * \param ops array of register accesses, see meram_write_icb_batch
+  * \param n number of entries in ops
+  * \retval -1 Failure (no register has been written)
+  * 	     0 Success
+  */
+int meram_write_reg_batch(MERAM *meram, MERAM_REG *meram_reg,
+		const struct meram_reg_op *ops, int n);
+
+/**
+  * Read several MERAM common registers in one call
+  * \param meram MERAM handle
+  * \param meram_reg handle to common registers
+  * \param ops array of register accesses, see meram_read_icb_batch
+  * \param n number of entries in ops
+  * \retval -1 Failure
+  * 	     0 Success
+  */
+int meram_read_reg_batch(MERAM *meram, MERAM_REG *meram_reg,
+		struct meram_reg_op *ops, int n);
+
+/**
+  * Enable or disable the register shadow of a MERAM handle
+  * With the shadow enabled, ICB and common registers accessed through
+  * this handle are mirrored in memory while the ICB or the common
+  * registers are locked: writes of the value the register already holds
+  * are skipped and reads are served from the copy. Registers changed by
+  * the hardware (MExxCTRL, MEACTS) always go to the hardware.
+  * \param meram MERAM handle
+  * \param enable non-zero to enable the shadow
+  * \retval -1 Failure
+  * 	     0 Success
+  */
+int meram_set_shadow(MERAM *meram, int enable);
+
+/**
+  * Get the number of register writes issued and skipped by the shadow
+  * \param meram MERAM handle
+  * \param issued writes that reached the hardware (may be NULL)
+  * \param elided writes skipped because the value was unchanged
+  *               (may be NULL)
+  */
+void meram_get_shadow_stats(MERAM *meram, unsigned long *issued,
+		unsigned long *elided);
+
 /**
   * Get the address used to access a specific ICB
   * \param meram MERAM handle
@@ -239,6 +714,125 @@ int meram_write_reg(MERAM *meram, MERAM_REG *meram_reg, int offset,
   */
 unsigned long meram_get_icb_address(MERAM *meram, ICB *icb, int ab);
 
+/**
+  * Configure an ICB in a single call
+  * Allocates the MERAM memory needed for the configured number of lines
+  * (reusing the memory already associated with the ICB if it is large
+  * enough), derives the MExxMCNF, MExxBSIZE, MExxSBSIZE, MExxSSARA,
+  * MExxSSARB and MExxCTRL values from the description and writes them in
+  * the required order, MExxCTRL last.
+  * \param meram MERAM handle
+  * \param icb ICB handle
+  * \param cfg description of the plane to cache
+  * \retval -1 Failure (invalid description or out of MERAM memory)
+  * 	     0 Success
+  */
+int meram_configure_icb(MERAM *meram, ICB *icb,
+		const struct meram_icb_config *cfg);
+
+/**
+  * Compute the MERAM layout of an image without touching the hardware
+  * Each plane keeps its lines at the hardware line pitch, the line
+  * length rounded up to a power of two from MERAM_PITCH_MIN to
+  * MERAM_PITCH_MAX bytes. The planes are packed in a single extent, e.g.
+  * the luma and chroma of an NV12 image, each starting at the first
+  * block after the last line of the previous one rather than at a
+  * separately allocated power of two. The resulting register values
+  * have MSAR relative to the start of the extent.
+  * \param cfgs description of each plane
+  * \param n number of planes (1 to MERAM_MAX_PLANES)
+  * \param layout resulting layout
+  * \retval -1 Failure (invalid description)
+  * 	     0 Success
+  */
+int meram_calc_layout(const struct meram_icb_config *cfgs, int n,
+		struct meram_layout *layout);
+
+/**
+  * Configure the ICBs of a multi-plane image in a single call
+  * Like meram_configure_icb, but the memory of all planes is allocated
+  * as one extent owned by icbs[0], laid out by meram_calc_layout. The
+  * memory is freed when icbs[0] is unlocked, so the other ICBs must be
+  * unlocked or reconfigured before or together with it.
+  * \param meram MERAM handle
+  * \param icbs ICB handle of each plane, all distinct
+  * \param cfgs description of each plane
+  * \param n number of planes (1 to MERAM_MAX_PLANES)
+  * \retval -1 Failure (invalid description or out of MERAM memory)
+  * 	     0 Success
+  */
+int meram_configure_planes(MERAM *meram, ICB **icbs,
+		const struct meram_icb_config *cfgs, int n);
+
+/**
+  * Plan the ICB and MERAM use of a set of concurrent streams
+  * Every stream is given its minimum number of lines, then the lines of
+  * the streams are doubled in order of priority for as long as all of
+  * them still fit in the currently free MERAM (i.e. after the meram.conf
+  * reservations and the allocations of all processes). ICBs are chosen
+  * among the extended ICBs not held by anyone. Nothing is locked or
+  * allocated: the plan is a snapshot that can be used for admission
+  * decisions and then applied with meram_lock_icb and
+  * meram_configure_planes.
+  * \param meram MERAM handle
+  * \param streams streams to plan for, output fields are filled in
+  * \param n number of streams
+  * \retval -1 Failure (the streams do not fit even with min_lines)
+  * 	     0 Success
+  */
+int meram_plan(MERAM *meram, struct meram_plan_stream *streams, int n);
+
+/**
+  * Let the library shrink and grow a configured ICB under MERAM pressure
+  * The ICB (with the other planes configured together with it by
+  * meram_configure_planes) keeps between min_lines and max_lines lines.
+  * Users of a higher priority can ask it to give back memory with
+  * meram_reclaim_memory; the owner applies such requests by calling
+  * meram_apply_icb_policy at frame boundaries.
+  * \param meram MERAM handle
+  * \param icb configured ICB handle (first plane)
+  * \param priority priority of the ICB, higher wins
+  * \param min_lines minimum number of lines to keep
+  * \param max_lines maximum number of lines to grow back to
+  * \param cb function called when the number of lines changed, may be 0
+  * \param arg argument passed to cb
+  * \retval -1 Failure
+  * 	     0 Success
+  */
+int meram_set_icb_policy(MERAM *meram, ICB *icb, int priority,
+		int min_lines, int max_lines, meram_shrink_cb cb, void *arg);
+
+/**
+  * Apply pending shrink requests to an ICB, or grow it back
+  * To be called by the owner of the ICB at a frame boundary, when the
+  * hardware is not using the ICB. The MERAM memory of the ICB is
+  * resized in place and its registers are reprogrammed. The first plane
+  * keeps its place in MERAM, but further planes (e.g. the chroma of
+  * NV12) move with the size of the first one, so the caller must
+  * reprogram or flush anything that addresses them directly, e.g. in
+  * the shrink callback.
+  * \param meram MERAM handle
+  * \param icb ICB handle with a policy set by meram_set_icb_policy
+  * \retval -1 Failure
+  * 	     0 Nothing changed
+  * 	     otherwise the new number of lines
+  */
+int meram_apply_icb_policy(MERAM *meram, ICB *icb);
+
+/**
+  * Ask ICBs of lower priority to give back MERAM memory
+  * Lowest priorities are asked first, and nobody is asked unless the
+  * full amount can be given back. The memory becomes free once the
+  * owners have called meram_apply_icb_policy, so the caller should
+  * retry its allocation at its next frame.
+  * \param meram MERAM handle
+  * \param blocks number of 1K blocks needed
+  * \param priority priority of the caller
+  * \retval -1 Failure (not enough memory can be given back)
+  * 	     otherwise the number of blocks asked for
+  */
+int meram_reclaim_memory(MERAM *meram, int blocks, int priority);
+
 /**
  * Get the required MERAM memory size calculated from a stride and number of
  * cache lines
@@ -247,6 +841,27 @@ unsigned long meram_get_icb_address(MERAM *meram, ICB *icb, int ab);
  * \retval size of block calculated from the parameters in 1K units
  */
 int meram_get_required_memory_size(int stride, int line_num);
+
+/**
+  * Formats of meram_trace_dump
+  */
+enum meram_trace_format {
+	MERAM_TRACE_CHROME,	/**< Chrome trace event JSON */
+	MERAM_TRACE_BINARY,	/**< raw records, see trace.c */
+};
+
+/**
+  * Write the events traced by all threads of the process to a file
+  * Lock wait and hold times, MERAM allocations and register accesses
+  * are only traced when the library was configured with --enable-trace.
+  * Each thread keeps its most recent events. Setting the MERAM_TRACE
+  * environment variable to a file name dumps them on exit.
+  * \param path file to write
+  * \param format MERAM_TRACE_CHROME or MERAM_TRACE_BINARY
+  * \retval -1 Failure (errno is ENOSYS if tracing is not built in)
+  * 	     0 Success
+  */
+int meram_trace_dump(const char *path, int format);
 #ifdef __cplusplus
 }
 #endif
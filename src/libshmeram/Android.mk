@@ -9,7 +9,19 @@ LOCAL_CFLAGS := -DCONFIG_FILE=\"/system/etc/meram.conf\"
 
 LOCAL_SRC_FILES := \
 	meram.c \
-	ipmmui.c
+	ipmmui.c \
+	buddy.c \
+	shared.c \
+	icb_config.c \
+	config.c \
+	fill.c \
+	async.c \
+	arena.c \
+	compact.c \
+	plan.c \
+	policy.c \
+	trace.c \
+	backend_uiomux.c
 
 LOCAL_SHARED_LIBRARIES := libcutils libuiomux
 
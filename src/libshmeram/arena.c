@@ -0,0 +1,98 @@
+#include <meram/meram.h>
+#include <stdlib.h>
+#include "meram_priv.h"
+
+/*
+ * Arenas carve short lived allocations out of one extent of MERAM
+ * blocks with a bump pointer, so that a whole frame worth of scratch
+ * buffers is given back with a single reset. The handle keeps a list of
+ * its arenas so that meram_close can free those left open.
+ */
+
+struct MERAM_ARENA {
+	MERAM *meram;
+	struct MERAM_ARENA *next;
+	int offset;
+	int size;
+	int used;
+};
+
+MERAM_ARENA *meram_arena_create(MERAM *meram, int size)
+{
+	MERAM_ARENA *arena;
+
+	if (!meram || size <= 0)
+		return NULL;
+	arena = calloc(1, sizeof(*arena));
+	if (!arena)
+		return NULL;
+	arena->offset = meram_alloc_memory_block(meram, size);
+	if (arena->offset < 0) {
+		free(arena);
+		return NULL;
+	}
+	arena->meram = meram;
+	arena->size = size;
+
+	pthread_mutex_lock(&meram->arena_mutex);
+	arena->next = meram->arenas;
+	meram->arenas = arena;
+	pthread_mutex_unlock(&meram->arena_mutex);
+	return arena;
+}
+
+int meram_arena_alloc(MERAM_ARENA *arena, int size)
+{
+	int used;
+
+	if (!arena || size <= 0)
+		return -1;
+	used = __atomic_load_n(&arena->used, __ATOMIC_RELAXED);
+	do {
+		if (size > arena->size - used)
+			return -1;
+	} while (!__atomic_compare_exchange_n(&arena->used, &used,
+		used + size, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return arena->offset + used;
+}
+
+void meram_arena_reset(MERAM_ARENA *arena)
+{
+	if (arena)
+		__atomic_store_n(&arena->used, 0, __ATOMIC_RELAXED);
+}
+
+void meram_arena_destroy(MERAM_ARENA *arena)
+{
+	MERAM *meram;
+	MERAM_ARENA **p;
+
+	if (!arena)
+		return;
+	meram = arena->meram;
+	pthread_mutex_lock(&meram->arena_mutex);
+	for (p = &meram->arenas; *p; p = &(*p)->next) {
+		if (*p == arena) {
+			*p = arena->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&meram->arena_mutex);
+	meram_free_memory_block(meram, arena->offset, arena->size);
+	free(arena);
+}
+
+void meram_arena_close_all(MERAM *meram)
+{
+	MERAM_ARENA *arena, *next;
+
+	pthread_mutex_lock(&meram->arena_mutex);
+	arena = meram->arenas;
+	meram->arenas = NULL;
+	pthread_mutex_unlock(&meram->arena_mutex);
+	for (; arena; arena = next) {
+		next = arena->next;
+		meram_free_memory_block(meram, arena->offset, arena->size);
+		free(arena);
+	}
+}
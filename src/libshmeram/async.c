@@ -0,0 +1,211 @@
+#include <meram/meram.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include "meram_priv.h"
+
+/*
+ * Background fills and copies of MERAM memory. Jobs are run in order by
+ * a single worker thread that is started with the first job and stopped
+ * when the last MERAM handle of the process is closed.
+ */
+
+enum meram_job_type {
+	MERAM_JOB_FILL,
+	MERAM_JOB_COPY_TO,
+	MERAM_JOB_COPY_FROM,
+};
+
+struct MERAM_JOB {
+	enum meram_job_type type;
+	MERAM *meram;
+	int offset;
+	int n_blocks;
+	int bits;
+	unsigned long long pattern;
+	void *buf;
+	size_t bytes;
+	int result;
+	int done;
+	struct MERAM_JOB *next;
+};
+
+static pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t async_done = PTHREAD_COND_INITIALIZER;
+static MERAM_JOB *queue_head, *queue_tail;
+static pthread_t worker;
+static int worker_running;
+static int worker_stop;
+
+static int meram_job_run(MERAM_JOB *job)
+{
+	switch (job->type) {
+	case MERAM_JOB_FILL:
+		return meram_fill_memory_pattern(job->meram, job->offset,
+			job->n_blocks, job->pattern, job->bits);
+	case MERAM_JOB_COPY_TO:
+		return meram_copy_to_memory_block(job->meram, job->offset,
+			job->buf, job->bytes);
+	case MERAM_JOB_COPY_FROM:
+		return meram_copy_from_memory_block(job->meram, job->offset,
+			job->buf, job->bytes);
+	}
+	return -1;
+}
+
+static void *meram_worker(void *arg)
+{
+	MERAM_JOB *job;
+
+	pthread_mutex_lock(&async_mutex);
+	for (;;) {
+		while (!queue_head && !worker_stop)
+			pthread_cond_wait(&async_queued, &async_mutex);
+		if (!queue_head)
+			break;
+		job = queue_head;
+		pthread_mutex_unlock(&async_mutex);
+
+		job->result = meram_job_run(job);
+
+		pthread_mutex_lock(&async_mutex);
+		/* only dequeue once done so that drain sees the job */
+		queue_head = job->next;
+		if (!queue_head)
+			queue_tail = NULL;
+		__atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&async_done);
+	}
+	pthread_mutex_unlock(&async_mutex);
+	return NULL;
+}
+
+static MERAM_JOB *meram_job_queue(MERAM_JOB *job)
+{
+	pthread_mutex_lock(&async_mutex);
+	if (!worker_running) {
+		worker_stop = 0;
+		if (pthread_create(&worker, NULL, meram_worker, NULL)) {
+			pthread_mutex_unlock(&async_mutex);
+			free(job);
+			return NULL;
+		}
+		worker_running = 1;
+	}
+	if (queue_tail)
+		queue_tail->next = job;
+	else
+		queue_head = job;
+	queue_tail = job;
+	pthread_cond_signal(&async_queued);
+	pthread_mutex_unlock(&async_mutex);
+	return job;
+}
+
+static MERAM_JOB *meram_job_new(MERAM *meram, enum meram_job_type type,
+	int offset)
+{
+	MERAM_JOB *job;
+
+	if (!meram)
+		return NULL;
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return NULL;
+	job->type = type;
+	job->meram = meram;
+	job->offset = offset;
+	return job;
+}
+
+MERAM_JOB *meram_fill_memory_async(MERAM *meram, int offset, int n_blocks,
+				   unsigned long long pattern, int bits)
+{
+	MERAM_JOB *job = meram_job_new(meram, MERAM_JOB_FILL, offset);
+
+	if (!job)
+		return NULL;
+	job->n_blocks = n_blocks;
+	job->pattern = pattern;
+	job->bits = bits;
+	return meram_job_queue(job);
+}
+
+MERAM_JOB *meram_copy_to_memory_async(MERAM *meram, int offset,
+				      const void *src, size_t bytes)
+{
+	MERAM_JOB *job = meram_job_new(meram, MERAM_JOB_COPY_TO, offset);
+
+	if (!job)
+		return NULL;
+	job->buf = (void *) src;
+	job->bytes = bytes;
+	return meram_job_queue(job);
+}
+
+MERAM_JOB *meram_copy_from_memory_async(MERAM *meram, int offset,
+					void *dst, size_t bytes)
+{
+	MERAM_JOB *job = meram_job_new(meram, MERAM_JOB_COPY_FROM, offset);
+
+	if (!job)
+		return NULL;
+	job->buf = dst;
+	job->bytes = bytes;
+	return meram_job_queue(job);
+}
+
+int meram_job_poll(MERAM_JOB *job)
+{
+	if (!job)
+		return -1;
+	return __atomic_load_n(&job->done, __ATOMIC_ACQUIRE);
+}
+
+int meram_job_wait(MERAM_JOB *job)
+{
+	int ret;
+
+	if (!job)
+		return -1;
+	pthread_mutex_lock(&async_mutex);
+	while (!job->done)
+		pthread_cond_wait(&async_done, &async_mutex);
+	pthread_mutex_unlock(&async_mutex);
+	ret = job->result;
+	free(job);
+	return ret;
+}
+
+/* wait for all queued jobs of @meram (or all jobs if NULL) to finish */
+void meram_async_drain(MERAM *meram)
+{
+	MERAM_JOB *job;
+	int busy;
+
+	pthread_mutex_lock(&async_mutex);
+	do {
+		busy = 0;
+		for (job = queue_head; job; job = job->next)
+			if (!meram || job->meram == meram)
+				busy = 1;
+		if (busy)
+			pthread_cond_wait(&async_done, &async_mutex);
+	} while (busy);
+	pthread_mutex_unlock(&async_mutex);
+}
+
+void meram_async_shutdown(void)
+{
+	int running;
+
+	pthread_mutex_lock(&async_mutex);
+	running = worker_running;
+	worker_stop = 1;
+	worker_running = 0;
+	pthread_cond_signal(&async_queued);
+	pthread_mutex_unlock(&async_mutex);
+	if (running)
+		pthread_join(worker, NULL);
+}
@@ -0,0 +1,174 @@
+#include <meram/meram.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "meram_priv.h"
+
+/*
+ * Simulated MERAM/IPMMUI. Register windows and the MERAM memory are
+ * anonymous mappings and locks are process local mutexes.
+ */
+
+#define SIM_MERAM_REG_PADDR	0xE8000000UL
+#define SIM_MERAM_REG_LEN	0x2000
+#define SIM_MERAM_MEM_PADDR	0xE8080000UL
+#define SIM_MERAM_MEM_LEN	(1536 << 10)
+#define SIM_IPMMUI_REG_PADDR	0xFE951000UL
+#define SIM_IPMMUI_REG_LEN	0x1000
+
+#define SIM_RESOURCES		2
+
+struct sim_region {
+	unsigned long paddr;
+	unsigned long len;
+	void *vaddr;
+};
+
+struct sim_uio {
+	struct sim_region mmio[SIM_RESOURCES];
+	struct sim_region mem;
+	pthread_mutex_t lock[SIM_RESOURCES];
+};
+
+static int sim_index(int resource)
+{
+	if (resource == UIOMUX_SH_MERAM)
+		return 0;
+	if (resource == UIOMUX_SH_IPMMUI)
+		return 1;
+	return -1;
+}
+
+static void *sim_map(unsigned long len)
+{
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+static void sim_close(void *uio)
+{
+	struct sim_uio *sim = uio;
+	int i;
+
+	if (!sim)
+		return;
+	for (i = 0; i < SIM_RESOURCES; i++) {
+		if (sim->mmio[i].vaddr)
+			munmap(sim->mmio[i].vaddr, sim->mmio[i].len);
+		pthread_mutex_destroy(&sim->lock[i]);
+	}
+	if (sim->mem.vaddr)
+		munmap(sim->mem.vaddr, sim->mem.len);
+	free(sim);
+}
+
+static void *sim_open(const char **names)
+{
+	struct sim_uio *sim;
+	int i;
+
+	sim = calloc(1, sizeof(*sim));
+	if (!sim)
+		return NULL;
+	for (i = 0; i < SIM_RESOURCES; i++)
+		pthread_mutex_init(&sim->lock[i], NULL);
+
+	sim->mmio[0].paddr = SIM_MERAM_REG_PADDR;
+	sim->mmio[0].len = SIM_MERAM_REG_LEN;
+	sim->mmio[1].paddr = SIM_IPMMUI_REG_PADDR;
+	sim->mmio[1].len = SIM_IPMMUI_REG_LEN;
+	sim->mem.paddr = SIM_MERAM_MEM_PADDR;
+	sim->mem.len = SIM_MERAM_MEM_LEN;
+
+	for (i = 0; i < SIM_RESOURCES; i++) {
+		sim->mmio[i].vaddr = sim_map(sim->mmio[i].len);
+		if (!sim->mmio[i].vaddr)
+			goto err;
+	}
+	sim->mem.vaddr = sim_map(sim->mem.len);
+	if (!sim->mem.vaddr)
+		goto err;
+	return sim;
+err:
+	sim_close(sim);
+	return NULL;
+}
+
+static int sim_get_region(struct sim_region *region, unsigned long *paddr,
+	unsigned long *len, void **vaddr)
+{
+	if (paddr)
+		*paddr = region->paddr;
+	if (len)
+		*len = region->len;
+	if (vaddr)
+		*vaddr = region->vaddr;
+	return 1;
+}
+
+static int sim_get_mmio(void *uio, int resource, unsigned long *paddr,
+	unsigned long *len, void **vaddr)
+{
+	struct sim_uio *sim = uio;
+	int i = sim_index(resource);
+
+	if (!sim || i < 0)
+		return 0;
+	return sim_get_region(&sim->mmio[i], paddr, len, vaddr);
+}
+
+static int sim_get_mem(void *uio, int resource, unsigned long *paddr,
+	unsigned long *len, void **vaddr)
+{
+	struct sim_uio *sim = uio;
+
+	/* only MERAM has internal memory */
+	if (!sim || resource != UIOMUX_SH_MERAM)
+		return 0;
+	return sim_get_region(&sim->mem, paddr, len, vaddr);
+}
+
+static int sim_lock(void *uio, int resource)
+{
+	struct sim_uio *sim = uio;
+	int i = sim_index(resource);
+
+	if (!sim || i < 0)
+		return -1;
+	return pthread_mutex_lock(&sim->lock[i]) ? -1 : 0;
+}
+
+static int sim_unlock(void *uio, int resource)
+{
+	struct sim_uio *sim = uio;
+	int i = sim_index(resource);
+
+	if (!sim || i < 0)
+		return -1;
+	return pthread_mutex_unlock(&sim->lock[i]) ? -1 : 0;
+}
+
+static int sim_partial_lock(void *uio, int resource, int offset, int count)
+{
+	return 0;
+}
+
+static int sim_partial_unlock(void *uio, int resource, int offset, int count)
+{
+	return 0;
+}
+
+const struct meram_backend_ops meram_sim_backend = {
+	.name		= "simulator",
+	.open		= sim_open,
+	.close		= sim_close,
+	.get_mmio	= sim_get_mmio,
+	.get_mem	= sim_get_mem,
+	.lock		= sim_lock,
+	.unlock		= sim_unlock,
+	.partial_lock	= sim_partial_lock,
+	.partial_unlock	= sim_partial_unlock,
+};
@@ -0,0 +1,67 @@
+#include <meram/meram.h>
+#include <uiomux/uiomux.h>
+#include "meram_priv.h"
+
+static void *uiomux_backend_open(const char **names)
+{
+	return uiomux_open_named(names);
+}
+
+static void uiomux_backend_close(void *uio)
+{
+	uiomux_close(uio);
+}
+
+static int uiomux_backend_get_mmio(void *uio, int resource,
+	unsigned long *paddr, unsigned long *len, void **vaddr)
+{
+	return uiomux_get_mmio(uio, resource, paddr, len, vaddr);
+}
+
+static int uiomux_backend_get_mem(void *uio, int resource,
+	unsigned long *paddr, unsigned long *len, void **vaddr)
+{
+	return uiomux_get_mem(uio, resource, paddr, len, vaddr);
+}
+
+static int uiomux_backend_lock(void *uio, int resource)
+{
+	return uiomux_lock(uio, resource);
+}
+
+static int uiomux_backend_unlock(void *uio, int resource)
+{
+	return uiomux_unlock(uio, resource);
+}
+
+static int uiomux_backend_partial_lock(void *uio, int resource,
+	int offset, int count)
+{
+#ifdef EXPERIMENTAL
+	return uiomux_partial_lock(uio, resource, offset, count);
+#else
+	return 0;
+#endif
+}
+
+static int uiomux_backend_partial_unlock(void *uio, int resource,
+	int offset, int count)
+{
+#ifdef EXPERIMENTAL
+	return uiomux_partial_unlock(uio, resource, offset, count);
+#else
+	return 0;
+#endif
+}
+
+const struct meram_backend_ops meram_uiomux_backend = {
+	.name		= "uiomux",
+	.open		= uiomux_backend_open,
+	.close		= uiomux_backend_close,
+	.get_mmio	= uiomux_backend_get_mmio,
+	.get_mem	= uiomux_backend_get_mem,
+	.lock		= uiomux_backend_lock,
+	.unlock		= uiomux_backend_unlock,
+	.partial_lock	= uiomux_backend_partial_lock,
+	.partial_unlock	= uiomux_backend_partial_unlock,
+};
@@ -0,0 +1,196 @@
+#include <meram/meram.h>
+#include "meram_priv.h"
+
+/*
+ * Buddy allocator over the MERAM memory blocks.
+ *
+ * Free chunks are kept in one doubly linked list per order. The lists
+ * are built from block indices rather than pointers so that the state
+ * does not depend on where it is mapped. Allocations are rounded up to
+ * a power of two for placement and the unused tail is returned to the
+ * free lists straight away, so a caller only ever owns the blocks it
+ * asked for. Since the MERAM is not a power of two in size (1536
+ * blocks), the top level is made up of the largest aligned chunks that
+ * fit.
+ */
+
+static void buddy_push(struct meram_buddy *b, int blk, int order)
+{
+	int head = b->head[order];
+
+	b->next[blk] = head;
+	b->prev[blk] = -1;
+	if (head >= 0)
+		b->prev[head] = blk;
+	b->head[order] = blk;
+	b->order[blk] = order;
+}
+
+static void buddy_unlink(struct meram_buddy *b, int blk)
+{
+	int order = b->order[blk];
+
+	if (b->prev[blk] >= 0)
+		b->next[b->prev[blk]] = b->next[blk];
+	else
+		b->head[order] = b->next[blk];
+	if (b->next[blk] >= 0)
+		b->prev[b->next[blk]] = b->prev[blk];
+	b->order[blk] = -1;
+}
+
+/* return a chunk to the free lists, merging it with its free buddies */
+static void buddy_free_chunk(struct meram_buddy *b, int blk, int order)
+{
+	while (order < MERAM_MAX_ORDER) {
+		int buddy = blk ^ (1 << order);
+
+		if (buddy + (1 << order) > b->nblocks ||
+		    b->order[buddy] != order)
+			break;
+		buddy_unlink(b, buddy);
+		if (buddy < blk)
+			blk = buddy;
+		order++;
+	}
+	buddy_push(b, blk, order);
+}
+
+/* largest order that @blk is aligned to and that fits in @count blocks */
+static int buddy_piece_order(int blk, int count)
+{
+	int order = 0;
+
+	while (order < MERAM_MAX_ORDER &&
+	       !(blk & (1 << order)) && (2 << order) <= count)
+		order++;
+	return order;
+}
+
+static int buddy_order(int count)
+{
+	int order = 0;
+
+	while ((1 << order) < count)
+		order++;
+	return order;
+}
+
+/*
+ * Remove the aligned chunk (@blk, @order) from the free lists, splitting
+ * the free chunk that contains it as required.
+ */
+static int buddy_claim_chunk(struct meram_buddy *b, int blk, int order)
+{
+	int o, base = -1;
+
+	for (o = order; o <= MERAM_MAX_ORDER; o++) {
+		int h = blk & ~((1 << o) - 1);
+		if (b->order[h] == o) {
+			base = h;
+			break;
+		}
+	}
+	if (base < 0)
+		return -1;
+
+	buddy_unlink(b, base);
+	while (o > order) {
+		int half;
+
+		o--;
+		half = 1 << o;
+		if (blk >= base + half) {
+			buddy_push(b, base, o);
+			base += half;
+		} else {
+			buddy_push(b, base + half, o);
+		}
+	}
+	return 0;
+}
+
+void meram_buddy_init(struct meram_buddy *b, int nblocks)
+{
+	int i, blk;
+
+	if (nblocks > MERAM_MAX_BLOCKS)
+		nblocks = MERAM_MAX_BLOCKS;
+	b->nblocks = nblocks;
+	for (i = 0; i <= MERAM_MAX_ORDER; i++)
+		b->head[i] = -1;
+	for (i = 0; i < MERAM_MAX_BLOCKS; i++) {
+		b->next[i] = b->prev[i] = -1;
+		b->order[i] = -1;
+	}
+
+	blk = 0;
+	while (blk < nblocks) {
+		int order = buddy_piece_order(blk, nblocks - blk);
+		buddy_push(b, blk, order);
+		blk += 1 << order;
+	}
+}
+
+int meram_buddy_alloc(struct meram_buddy *b, int count)
+{
+	int order, o, blk;
+
+	if (count <= 0 || count > b->nblocks)
+		return -1;
+	order = buddy_order(count);
+	if (order > MERAM_MAX_ORDER)
+		return -1;
+
+	for (o = order; o <= MERAM_MAX_ORDER; o++)
+		if (b->head[o] >= 0)
+			break;
+	if (o > MERAM_MAX_ORDER)
+		return -1;
+
+	blk = b->head[o];
+	buddy_unlink(b, blk);
+	while (o > order) {
+		o--;
+		buddy_push(b, blk + (1 << o), o);
+	}
+
+	/* give back the part of the power of two we do not need */
+	if ((1 << order) > count)
+		meram_buddy_free(b, blk + count, (1 << order) - count);
+	return blk;
+}
+
+int meram_buddy_claim(struct meram_buddy *b, int start, int count)
+{
+	int blk = start;
+
+	if (start < 0 || count <= 0 || start + count > b->nblocks)
+		return -1;
+
+	while (blk < start + count) {
+		int order = buddy_piece_order(blk, start + count - blk);
+		if (buddy_claim_chunk(b, blk, order) < 0) {
+			/* roll back what was claimed so far */
+			if (blk > start)
+				meram_buddy_free(b, start, blk - start);
+			return -1;
+		}
+		blk += 1 << order;
+	}
+	return 0;
+}
+
+void meram_buddy_free(struct meram_buddy *b, int start, int count)
+{
+	int blk = start;
+
+	if (start < 0 || count <= 0 || start + count > b->nblocks)
+		return;
+
+	while (blk < start + count) {
+		int order = buddy_piece_order(blk, start + count - blk);
+		buddy_free_chunk(b, blk, order);
+		blk += 1 << order;
+	}
+}
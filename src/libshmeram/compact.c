@@ -0,0 +1,92 @@
+#include <meram/meram.h>
+#include <stdlib.h>
+#include "meram_priv.h"
+
+/*
+ * Compaction of ICB memory. The caller owns the ICBs and guarantees
+ * that the hardware is not using them (e.g. between two frames), so
+ * their data can be moved: each ICB memory is copied to the lowest free
+ * place below it, its MExxCTRL.MSAR (and that of the other planes sharing
+ * the memory) is pointed at the copy and the old blocks are freed.
+ * Moving the allocations towards the start of MERAM leaves larger free
+ * runs behind them.
+ */
+
+static int icb_cmp_block(const void *a, const void *b)
+{
+	const ICB *x = *(ICB * const *) a, *y = *(ICB * const *) b;
+
+	return x->mem_block - y->mem_block;
+}
+
+/*
+ * Returns 1 if the ICB was moved, 0 if there was no room below it and
+ * -1 if its old blocks could not be freed. The new blocks are taken
+ * under the tag of the handle that owns the ICB memory, which need not
+ * be @meram.
+ */
+static int meram_move_icb(MERAM *meram, ICB *icb)
+{
+	int old = icb->mem_block, size = icb->mem_size;
+	unsigned long ctrl;
+	ICB *plane;
+	int blk;
+
+	blk = meram_shared_alloc_lowest(meram->shared, size, old,
+		icb->mem_tag);
+	if (blk < 0)
+		return 0;
+
+	/* the new blocks are below the old ones, they cannot overlap */
+	meram_copy_to_memory_block(meram, blk,
+		(char *) meram->mem_vaddr + (old << MERAM_BLOCK_SHIFT),
+		size << MERAM_BLOCK_SHIFT);
+	for (plane = icb; plane; plane = plane->plane_next) {
+		meram_read_icb(meram, plane, MExxCTRL, &ctrl);
+		ctrl = (ctrl & ~MExxCTRL_MSAR_MASK) |
+			(((blk + plane->plane_block) << MExxCTRL_MSAR_SHIFT) &
+			 MExxCTRL_MSAR_MASK);
+		meram_write_icb(meram, plane, MExxCTRL, ctrl);
+	}
+	__sync_synchronize();
+
+	icb->mem_block = blk;
+	if (meram_shared_free_blocks(meram->shared, old, size,
+				     icb->mem_tag) < 0)
+		return -1;
+	return 1;
+}
+
+int meram_compact_icbs(MERAM *meram, ICB **icbs, int n)
+{
+	ICB **sorted;
+	int i, ret, moved = 0;
+
+	if (!meram || !icbs || n < 0)
+		return -1;
+	sorted = malloc(n * sizeof(*sorted));
+	if (!sorted && n)
+		return -1;
+	for (i = 0; i < n; i++) {
+		if (!icbs[i] || !icbs[i]->locked) {
+			free(sorted);
+			return -1;
+		}
+		sorted[i] = icbs[i];
+	}
+
+	/* move the lowest first, so each move can use the space left below */
+	qsort(sorted, n, sizeof(*sorted), icb_cmp_block);
+	for (i = 0; i < n; i++) {
+		if (sorted[i]->mem_block < 0 || sorted[i]->mem_size <= 0)
+			continue;
+		ret = meram_move_icb(meram, sorted[i]);
+		if (ret < 0) {
+			moved = -1;
+			break;
+		}
+		moved += ret;
+	}
+	free(sorted);
+	return moved;
+}
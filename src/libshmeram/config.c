@@ -0,0 +1,554 @@
+#include <meram/meram.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "meram_priv.h"
+
+/*
+ * meram.conf, compiled into sorted arrays.
+ *
+ * The file is only read by the first call that needs its contents;
+ * attaching the shared MERAM state only looks at its stamp (see
+ * meram_config_stamp) unless it changed since it was applied. The compiled
+ * arrays are kept in a POSIX shared memory object together with the
+ * mtime, size and inode of the file they came from; later processes of
+ * the same user that use the same file map that image instead of
+ * parsing it again, for as long as the file is unchanged. The MERAM_CONF environment variable
+ * names another file to use instead of CONFIG_FILE; the MERAM state of
+ * such a process is not shared, so that its reservations do not apply
+ * to everyone else.
+ *
+ * Tags are also interned into an open addressing hash table that is
+ * part of the image, and the index of a tag's entry doubles as the tag
+ * handle given out by ipmmui_get_tag.
+ */
+
+#define CONF_CACHE_MAGIC	0x4d45434e	/* "MECN" */
+#define CONF_CACHE_VERSION	3
+
+struct conf_image {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t src_dev;
+	uint64_t src_ino;
+	int64_t src_size;
+	int64_t src_mtime_sec;
+	int64_t src_mtime_nsec;
+	uint32_t n_reserved;
+	uint32_t n_ipmmui;
+	uint32_t hash_size;
+	uint32_t strings_len;
+	uint32_t total_len;
+	/*
+	 * followed by the reserved ranges, ipmmui entries, tag hash buckets
+	 * and tag strings
+	 */
+};
+
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+static struct meram_config config;
+
+static size_t conf_image_len(int n_reserved, int n_ipmmui, int hash_size,
+	size_t strings)
+{
+	return sizeof(struct conf_image) +
+		n_reserved * sizeof(struct reserved_address) +
+		n_ipmmui * sizeof(struct ipmmui_settings) +
+		hash_size * sizeof(uint32_t) + strings;
+}
+
+/* point @cfg at the arrays of an image */
+static void conf_image_use(struct meram_config *cfg, struct conf_image *img)
+{
+	char *p = (char *) (img + 1);
+
+	cfg->image = img;
+	cfg->n_reserved = img->n_reserved;
+	cfg->reserved = (struct reserved_address *) p;
+	p += img->n_reserved * sizeof(struct reserved_address);
+	cfg->n_ipmmui = img->n_ipmmui;
+	cfg->ipmmui = (struct ipmmui_settings *) p;
+	p += img->n_ipmmui * sizeof(struct ipmmui_settings);
+	cfg->hash_size = img->hash_size;
+	cfg->hash = (uint32_t *) p;
+	p += img->hash_size * sizeof(uint32_t);
+	cfg->strings = p;
+}
+
+/*
+ * Check everything later used as an index into the image, so that a
+ * damaged or stale cache cannot make lookups read out of bounds or
+ * probe forever.
+ */
+static int conf_image_tables_valid(const struct conf_image *img)
+{
+	struct meram_config cfg;
+	uint32_t i;
+
+	conf_image_use(&cfg, (struct conf_image *) img);
+	for (i = 0; i < img->n_reserved; i++)
+		if (cfg.reserved[i].start_block < 0 ||
+		    cfg.reserved[i].end_block < cfg.reserved[i].start_block ||
+		    (i && cfg.reserved[i].start_block <=
+			  cfg.reserved[i - 1].end_block))
+			return 0;
+	/* at least one empty bucket ends every probe sequence */
+	if (img->n_ipmmui && img->hash_size <= img->n_ipmmui)
+		return 0;
+	if (img->strings_len && cfg.strings[img->strings_len - 1])
+		return 0;
+	for (i = 0; i < img->n_ipmmui; i++)
+		if (cfg.ipmmui[i].tag >= img->strings_len)
+			return 0;
+	for (i = 0; i < img->hash_size; i++)
+		if (cfg.hash[i] > img->n_ipmmui)
+			return 0;
+	return 1;
+}
+
+static int conf_image_valid(const struct conf_image *img, size_t len,
+	const struct stat *st)
+{
+	return len >= sizeof(*img) &&
+		img->magic == CONF_CACHE_MAGIC &&
+		img->version == CONF_CACHE_VERSION &&
+		img->total_len == len &&
+		/* keep conf_image_len from overflowing */
+		img->n_reserved <= len / sizeof(struct reserved_address) &&
+		img->n_ipmmui <= len / sizeof(struct ipmmui_settings) &&
+		img->hash_size <= len / sizeof(uint32_t) &&
+		img->strings_len <= len &&
+		img->total_len == conf_image_len(img->n_reserved,
+			img->n_ipmmui, img->hash_size, img->strings_len) &&
+		(img->hash_size & (img->hash_size - 1)) == 0 &&
+		img->src_dev == (uint64_t) st->st_dev &&
+		img->src_ino == (uint64_t) st->st_ino &&
+		img->src_size == (int64_t) st->st_size &&
+		img->src_mtime_sec == (int64_t) st->st_mtim.tv_sec &&
+		img->src_mtime_nsec == (int64_t) st->st_mtim.tv_nsec &&
+		conf_image_tables_valid(img);
+}
+
+static const char *meram_config_path(void)
+{
+	const char *path = getenv("MERAM_CONF");
+
+	if (!path || !*path)
+		path = CONFIG_FILE;
+	return path;
+}
+
+#ifndef MERAM_PROCESS_LOCAL
+
+/*
+ * Each user has its own cache, only writable by that user, so that a
+ * process never uses an image written by another user. Each file has
+ * its own cache too, named after an FNV-1a hash of its path, so that
+ * processes using MERAM_CONF and those using CONFIG_FILE do not keep
+ * replacing each other's image.
+ */
+static void conf_cache_name(char *name, size_t len, const char *path)
+{
+	uint32_t h = 2166136261U;
+
+	for (; *path; path++)
+		h = (h ^ (uint8_t) *path) * 16777619U;
+	snprintf(name, len, "%s-conf.%d.%u.%08x", MERAM_SHM_NAME,
+		 CONF_CACHE_VERSION, (unsigned int) geteuid(), h);
+}
+
+/*
+ * Copy a valid cached image. The image is copied rather than kept
+ * mapped, so that another process can rewrite the cache at any time.
+ * An object that is not ours is ignored, whoever created it first.
+ */
+static struct conf_image *conf_cache_load(const char *path,
+	const struct stat *st)
+{
+	struct conf_image *img = NULL;
+	struct stat cst;
+	char name[64];
+	void *map;
+	int fd;
+
+	conf_cache_name(name, sizeof(name), path);
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+	if (flock(fd, LOCK_SH) < 0 || fstat(fd, &cst) < 0 ||
+	    cst.st_uid != geteuid() || cst.st_size < (off_t) sizeof(*img))
+		goto out;
+	map = mmap(NULL, cst.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto out;
+	if (conf_image_valid(map, cst.st_size, st)) {
+		img = malloc(cst.st_size);
+		if (img)
+			memcpy(img, map, cst.st_size);
+	}
+	munmap(map, cst.st_size);
+out:
+	close(fd);
+	return img;
+}
+
+static void conf_cache_store(const char *path,
+	const struct conf_image *img)
+{
+	struct stat cst;
+	char name[64];
+	int fd;
+
+	conf_cache_name(name, sizeof(name), path);
+	fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &cst) == 0 && cst.st_uid == geteuid() &&
+	    flock(fd, LOCK_EX) == 0 && ftruncate(fd, 0) == 0 &&
+	    write(fd, img, img->total_len) != (ssize_t) img->total_len)
+		ftruncate(fd, 0);
+	close(fd);
+}
+
+#else
+
+/* no POSIX shared memory, every process parses the file */
+static struct conf_image *conf_cache_load(const char *path,
+	const struct stat *st)
+{
+	return NULL;
+}
+
+static void conf_cache_store(const char *path,
+	const struct conf_image *img)
+{
+}
+
+#endif
+
+static int cmp_reserved(const void *a, const void *b)
+{
+	const struct reserved_address *ra = a, *rb = b;
+
+	if (ra->start_block != rb->start_block)
+		return ra->start_block < rb->start_block ? -1 : 1;
+	return (ra->end_block > rb->end_block) - (ra->end_block < rb->end_block);
+}
+
+/*
+ * Sort the reserved ranges and merge the ones that overlap or touch, so
+ * that both their starts and their ends are in ascending order. Returns
+ * the number of ranges left.
+ */
+static int normalize_reserved(struct reserved_address *r, int n)
+{
+	int i, out = 0;
+
+	qsort(r, n, sizeof(*r), cmp_reserved);
+	for (i = 0; i < n; i++) {
+		if (r[i].start_block < 0)
+			r[i].start_block = 0;
+		if (r[i].end_block < r[i].start_block)
+			continue;
+		if (out && r[i].start_block <= r[out - 1].end_block + 1) {
+			if (r[i].end_block > r[out - 1].end_block)
+				r[out - 1].end_block = r[i].end_block;
+			continue;
+		}
+		r[out++] = r[i];
+	}
+	return out;
+}
+
+/* FNV-1a */
+static uint32_t tag_hash(const char *tag)
+{
+	uint32_t h = 2166136261U;
+
+	while (*tag)
+		h = (h ^ (uint8_t) *tag++) * 16777619U;
+	return h;
+}
+
+static int hash_find(const uint32_t *hash, int hash_size,
+	const struct ipmmui_settings *ipmmui, const char *strings,
+	const char *tag, uint32_t h)
+{
+	uint32_t mask = hash_size - 1, i, n;
+
+	if (!hash_size)
+		return -1;
+	/* buckets hold the entry index + 1, 0 is empty */
+	for (i = h & mask, n = 0; n < (uint32_t) hash_size && hash[i];
+	     i = (i + 1) & mask, n++) {
+		const struct ipmmui_settings *s = &ipmmui[hash[i] - 1];
+
+		if (s->hash == h && !strcmp(strings + s->tag, tag))
+			return hash[i] - 1;
+	}
+	return -1;
+}
+
+/* intern the tags of the sorted entries, the first entry of a tag wins */
+static void hash_build(uint32_t *hash, int hash_size,
+	const struct ipmmui_settings *ipmmui, int n, const char *strings)
+{
+	uint32_t mask = hash_size - 1, i, probes;
+	int j;
+
+	for (j = 0; j < n; j++) {
+		if (hash_find(hash, hash_size, ipmmui, strings,
+			      strings + ipmmui[j].tag, ipmmui[j].hash) >= 0)
+			continue;
+		for (i = ipmmui[j].hash & mask, probes = 0;
+		     probes < (uint32_t) hash_size && hash[i];
+		     i = (i + 1) & mask, probes++)
+			;
+		if (probes < (uint32_t) hash_size)
+			hash[i] = j + 1;
+	}
+}
+
+/* tags are sorted, duplicates stay in file order so the first one wins */
+static const char *sort_strings;
+
+static int cmp_ipmmui(const void *a, const void *b)
+{
+	const struct ipmmui_settings *ia = a, *ib = b;
+	int ret = strcmp(sort_strings + ia->tag, sort_strings + ib->tag);
+
+	if (ret)
+		return ret;
+	return (ia->line > ib->line) - (ia->line < ib->line);
+}
+
+#define TOKENS " \t\n"
+#define LINE_LEN 255
+#define MAX_FIELDS 3
+
+/*
+ * Parse @infile into a new image. On a syntax error the entries read so
+ * far are kept, as they always were, but -1 is returned so the result
+ * is not cached.
+ */
+static int parse_config_file(const char *infile, struct conf_image **out)
+{
+	struct reserved_address *reserved = NULL, *r;
+	struct ipmmui_settings *ipmmui = NULL, *s;
+	int n_reserved = 0, n_ipmmui = 0, hash_size = 0, i, num_fields;
+	int ret = 0;
+	size_t strings_len = 0, tag_len;
+	char *strings = NULL, *p;
+	char *fields[MAX_FIELDS];
+	struct conf_image *img;
+	FILE *cfg_file;
+	char linedata[LINE_LEN];
+	int line_cnt = 0;
+	char *id;
+
+	*out = NULL;
+	cfg_file = fopen(infile, "r");
+	if (!cfg_file)
+		return -1;
+
+	while (fgets(linedata, sizeof(linedata), cfg_file)) {
+		line_cnt++;
+		id = strtok(linedata, TOKENS);
+		if (!id || id[0] == '#')
+			continue;
+		if (!strcmp(id, "reserved"))
+			num_fields = 2;
+		else if (!strcmp(id, "ipmmui"))
+			num_fields = 3;
+		else
+			continue;
+
+		for (i = 0; i < num_fields; i++) {
+			if (!(fields[i] = strtok(NULL, TOKENS))) {
+				fprintf(stderr, "Line %d: "
+					"Invalid data\n", line_cnt);
+				ret = -1;
+				goto done;
+			}
+		}
+		if (strtok(NULL, TOKENS)) {
+			fprintf(stderr, "Line %d: Too few tokens\n",
+				line_cnt);
+			ret = -1;
+			goto done;
+		}
+		if (num_fields == 2) {
+			r = realloc(reserved, (n_reserved + 1) * sizeof(*r));
+			if (!r)
+				goto nomem;
+			reserved = r;
+			r += n_reserved++;
+			r->start_block = atoi(fields[0]);
+			r->end_block = atoi(fields[1]);
+		} else {
+			tag_len = strlen(fields[0]) + 1;
+			s = realloc(ipmmui, (n_ipmmui + 1) * sizeof(*s));
+			if (!s)
+				goto nomem;
+			ipmmui = s;
+			p = realloc(strings, strings_len + tag_len);
+			if (!p)
+				goto nomem;
+			strings = p;
+			memcpy(strings + strings_len, fields[0], tag_len);
+			s += n_ipmmui++;
+			s->tag = strings_len;
+			s->hash = tag_hash(fields[0]);
+			s->line = line_cnt;
+			s->vaddr = strtoul(fields[1], NULL, 0);
+			s->size = atoi(fields[2]);
+			strings_len += tag_len;
+		}
+	}
+	goto done;
+nomem:
+	ret = -1;
+done:
+	fclose(cfg_file);
+
+	n_reserved = normalize_reserved(reserved, n_reserved);
+	/* keep the hash table at most half full */
+	if (n_ipmmui)
+		for (hash_size = 4; hash_size < 2 * n_ipmmui; hash_size <<= 1)
+			;
+	img = calloc(1, conf_image_len(n_reserved, n_ipmmui, hash_size,
+				       strings_len));
+	if (img) {
+		img->magic = CONF_CACHE_MAGIC;
+		img->version = CONF_CACHE_VERSION;
+		img->n_reserved = n_reserved;
+		img->n_ipmmui = n_ipmmui;
+		img->hash_size = hash_size;
+		img->strings_len = strings_len;
+		img->total_len = conf_image_len(n_reserved, n_ipmmui,
+						hash_size, strings_len);
+		p = (char *) (img + 1);
+		if (n_reserved)
+			memcpy(p, reserved, n_reserved * sizeof(*reserved));
+		p += n_reserved * sizeof(*reserved);
+		if (n_ipmmui)
+			memcpy(p, ipmmui, n_ipmmui * sizeof(*ipmmui));
+		sort_strings = strings;
+		qsort(p, n_ipmmui, sizeof(*ipmmui), cmp_ipmmui);
+		sort_strings = NULL;
+		hash_build((uint32_t *) (p + n_ipmmui * sizeof(*ipmmui)),
+			   hash_size, (struct ipmmui_settings *) p, n_ipmmui,
+			   strings);
+		p += n_ipmmui * sizeof(*ipmmui) + hash_size * sizeof(uint32_t);
+		if (strings_len)
+			memcpy(p, strings, strings_len);
+	} else {
+		ret = -1;
+	}
+	free(reserved);
+	free(ipmmui);
+	free(strings);
+	*out = img;
+	return ret;
+}
+
+static void meram_config_load(void)
+{
+	const char *path = meram_config_path();
+	struct conf_image *img = NULL;
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		return;
+	img = conf_cache_load(path, &st);
+	if (!img) {
+		/* runs under pthread_once, so the sort comparator is safe */
+		if (parse_config_file(path, &img) == 0) {
+			img->src_dev = st.st_dev;
+			img->src_ino = st.st_ino;
+			img->src_size = st.st_size;
+			img->src_mtime_sec = st.st_mtim.tv_sec;
+			img->src_mtime_nsec = st.st_mtim.tv_nsec;
+			conf_cache_store(path, img);
+		}
+		if (!img)
+			return;
+	}
+	conf_image_use(&config, img);
+}
+
+/* is a file other than CONFIG_FILE used, see MERAM_CONF? */
+int meram_config_private(void)
+{
+	const char *path = getenv("MERAM_CONF");
+
+	return path && *path;
+}
+
+/*
+ * FNV-1a over the inode, size and mtime of the file, or 0 if there is
+ * none, to tell whether it changed without reading it.
+ */
+uint32_t meram_config_stamp(void)
+{
+	uint64_t id[5];
+	const uint8_t *p = (const uint8_t *) id;
+	uint32_t h = 2166136261U;
+	struct stat st;
+	size_t i;
+
+	if (stat(meram_config_path(), &st) < 0)
+		return 0;
+	id[0] = st.st_dev;
+	id[1] = st.st_ino;
+	id[2] = st.st_size;
+	id[3] = st.st_mtim.tv_sec;
+	id[4] = st.st_mtim.tv_nsec;
+	for (i = 0; i < sizeof(id); i++)
+		h = (h ^ p[i]) * 16777619U;
+	return h;
+}
+
+const struct meram_config *meram_config_get(void)
+{
+	pthread_once(&config_once, meram_config_load);
+	return &config;
+}
+
+/* index of the entry for @tag, which is also its tag handle, or -1 */
+int meram_config_find_ipmmui(const char *tag)
+{
+	const struct meram_config *cfg = meram_config_get();
+
+	return hash_find(cfg->hash, cfg->hash_size, cfg->ipmmui, cfg->strings,
+			 tag, tag_hash(tag));
+}
+
+/*
+ * Index of the first reserved range that overlaps blocks @start to
+ * @start + @count - 1, or -1 if there is none.
+ */
+int meram_config_reserved_overlap(int start, int count)
+{
+	const struct meram_config *cfg = meram_config_get();
+	int lo = 0, hi = cfg->n_reserved, mid;
+
+	/* ranges are disjoint and sorted, so their ends are sorted too */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cfg->reserved[mid].end_block < start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < cfg->n_reserved &&
+	    cfg->reserved[lo].start_block <= start + count - 1)
+		return lo;
+	return -1;
+}
@@ -0,0 +1,198 @@
+#include <meram/meram.h>
+#include <stdint.h>
+#include <string.h>
+#include "meram_priv.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+ * Bulk access to the MERAM internal memory. Blocks are 1KB and the
+ * memory is page aligned, so every block range is a whole number of
+ * 64 byte lines and the vector loops need no head or tail handling.
+ * Fills use streaming stores where available: MERAM is not read back
+ * by the CPU right after a clear, so there is no point in pulling it
+ * through the cache.
+ */
+
+#define FILL_LINE	64
+
+typedef uint8_t u8;
+
+static void fill_lines(void *dst, uint64_t pattern, size_t bytes)
+{
+#if defined(__SSE2__)
+	__m128i v = _mm_set1_epi64x(pattern);
+	__m128i *p = dst;
+	size_t i;
+
+	for (i = 0; i < bytes / FILL_LINE; i++, p += 4) {
+		_mm_stream_si128(p, v);
+		_mm_stream_si128(p + 1, v);
+		_mm_stream_si128(p + 2, v);
+		_mm_stream_si128(p + 3, v);
+	}
+	_mm_sfence();
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+	uint64x2_t v = vdupq_n_u64(pattern);
+	uint64_t *p = dst;
+	size_t i;
+
+	for (i = 0; i < bytes / FILL_LINE; i++, p += 8) {
+		vst1q_u64(p, v);
+		vst1q_u64(p + 2, v);
+		vst1q_u64(p + 4, v);
+		vst1q_u64(p + 6, v);
+	}
+#else
+	uint64_t *p = dst;
+	size_t i;
+
+	for (i = 0; i < bytes / sizeof(*p); i++)
+		p[i] = pattern;
+#endif
+}
+
+static void copy_lines(void *dst, const void *src, size_t bytes)
+{
+#if defined(__SSE2__)
+	const __m128i *s = src;
+	__m128i *d = dst;
+	size_t i;
+
+	for (i = 0; i < bytes / FILL_LINE; i++, s += 4, d += 4) {
+		__m128i a = _mm_load_si128(s);
+		__m128i b = _mm_load_si128(s + 1);
+		__m128i c = _mm_load_si128(s + 2);
+		__m128i e = _mm_load_si128(s + 3);
+		_mm_store_si128(d, a);
+		_mm_store_si128(d + 1, b);
+		_mm_store_si128(d + 2, c);
+		_mm_store_si128(d + 3, e);
+	}
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+	const uint64_t *s = src;
+	uint64_t *d = dst;
+	size_t i;
+
+	for (i = 0; i < bytes / FILL_LINE; i++, s += 8, d += 8) {
+		uint64x2_t a = vld1q_u64(s);
+		uint64x2_t b = vld1q_u64(s + 2);
+		uint64x2_t c = vld1q_u64(s + 4);
+		uint64x2_t e = vld1q_u64(s + 6);
+		vst1q_u64(d, a);
+		vst1q_u64(d + 2, b);
+		vst1q_u64(d + 4, c);
+		vst1q_u64(d + 6, e);
+	}
+#else
+	memcpy(dst, src, bytes / FILL_LINE * FILL_LINE);
+#endif
+}
+
+/* copy with the vector loop when both sides allow it, memcpy otherwise */
+static void meram_copy(void *dst, const void *src, size_t bytes)
+{
+	size_t lines = bytes & ~(size_t) (FILL_LINE - 1);
+
+	if ((((uintptr_t) dst | (uintptr_t) src) & 15) == 0) {
+		copy_lines(dst, src, lines);
+		dst = (u8 *) dst + lines;
+		src = (const u8 *) src + lines;
+		bytes -= lines;
+	}
+	if (bytes)
+		memcpy(dst, src, bytes);
+}
+
+/* replicate a pattern of @bits bits over 64 bits */
+static int meram_pattern64(unsigned long long pattern, int bits,
+	uint64_t *out)
+{
+	uint64_t v;
+
+	switch (bits) {
+	case 8:
+		v = pattern & 0xff;
+		v |= v << 8;
+		v |= v << 16;
+		v |= v << 32;
+		break;
+	case 16:
+		v = pattern & 0xffff;
+		v |= v << 16;
+		v |= v << 32;
+		break;
+	case 32:
+		v = pattern & 0xffffffff;
+		v |= v << 32;
+		break;
+	case 64:
+		v = pattern;
+		break;
+	default:
+		return -1;
+	}
+	*out = v;
+	return 0;
+}
+
+static void *meram_block_ptr(MERAM *meram, int offset, int n_blocks)
+{
+	unsigned long nblocks;
+
+	if (!meram || offset < 0 || n_blocks <= 0)
+		return NULL;
+	nblocks = meram->mem_len >> MERAM_BLOCK_SHIFT;
+	if ((unsigned long) offset + n_blocks > nblocks)
+		return NULL;
+	return (u8 *) meram->mem_vaddr +
+		((unsigned long) offset << MERAM_BLOCK_SHIFT);
+}
+
+int meram_fill_memory_pattern(MERAM *meram, int offset, int n_blocks,
+			      unsigned long long pattern, int bits)
+{
+	void *dst = meram_block_ptr(meram, offset, n_blocks);
+	uint64_t v;
+
+	if (!dst || meram_pattern64(pattern, bits, &v) < 0)
+		return -1;
+	fill_lines(dst, v, (size_t) n_blocks << MERAM_BLOCK_SHIFT);
+	return 0;
+}
+
+void meram_fill_memory_block(MERAM *meram, int offset,
+			     int n_blocks, unsigned int val)
+{
+	meram_fill_memory_pattern(meram, offset, n_blocks, val, 32);
+}
+
+int meram_copy_to_memory_block(MERAM *meram, int offset, const void *src,
+			       size_t bytes)
+{
+	int n_blocks = (bytes + (1 << MERAM_BLOCK_SHIFT) - 1) >>
+		MERAM_BLOCK_SHIFT;
+	void *dst = meram_block_ptr(meram, offset, n_blocks);
+
+	if (!dst || !src)
+		return -1;
+	meram_copy(dst, src, bytes);
+	return 0;
+}
+
+int meram_copy_from_memory_block(MERAM *meram, int offset, void *dst,
+				 size_t bytes)
+{
+	int n_blocks = (bytes + (1 << MERAM_BLOCK_SHIFT) - 1) >>
+		MERAM_BLOCK_SHIFT;
+	void *src = meram_block_ptr(meram, offset, n_blocks);
+
+	if (!src || !dst)
+		return -1;
+	meram_copy(dst, src, bytes);
+	return 0;
+}
@@ -0,0 +1,278 @@
+#include <meram/meram.h>
+#include <stdlib.h>
+#include "meram_priv.h"
+
+/* bytes per pixel of a plane, -1 for unknown formats */
+static int meram_format_bpp(int format)
+{
+	switch (format) {
+	case MERAM_PF_Y8:
+	case MERAM_PF_CBCR420:
+	case MERAM_PF_CBCR422:
+		/* interleaved chroma has one byte per luma pixel */
+		return 1;
+	case MERAM_PF_RGB565:
+		return 2;
+	case MERAM_PF_RGB888:
+		return 3;
+	case MERAM_PF_RGBX8888:
+		return 4;
+	}
+	return -1;
+}
+
+/* number of lines of the plane for an image of @height lines */
+static int meram_format_height(int format, int height)
+{
+	if (format == MERAM_PF_CBCR420)
+		return height / 2;
+	return height;
+}
+
+/*
+ * The ICB keeps its lines in MERAM at the line length rounded up to a
+ * power of two between MERAM_PITCH_MIN and MERAM_PITCH_MAX, as the
+ * sh_mobile_meram driver does, since MExxMCNF only holds a line count.
+ * Only the end of the last line is not used by the ICB, so the next
+ * plane starts at the first block after it: MSAR counts blocks.
+ */
+static int meram_calc_plane(const struct meram_icb_config *cfg, int block,
+	struct meram_plane_layout *pl)
+{
+	int bpp, bpl, stride, height;
+
+	bpp = meram_format_bpp(cfg->format);
+	if (bpp < 0 || cfg->width <= 0 || cfg->height < 2)
+		return -1;
+	if (cfg->mode != MERAM_ICB_READ && cfg->mode != MERAM_ICB_WRITE)
+		return -1;
+	/* BNM holds the number of lines less one in 8 bits */
+	if (cfg->lines < 1 || cfg->lines > 256)
+		return -1;
+
+	bpl = cfg->width * bpp;
+	stride = cfg->stride ? cfg->stride : bpl;
+	height = meram_format_height(cfg->format, cfg->height);
+	if (stride < bpl || stride > 0xffff || height < 1 || height > 0x1000)
+		return -1;
+	if (bpl > MERAM_PITCH_MAX)
+		return -1;
+
+	for (pl->pitch = MERAM_PITCH_MIN; pl->pitch < bpl; pl->pitch <<= 1)
+		;
+	pl->block = block;
+	pl->size = ((unsigned long) pl->pitch * (cfg->lines - 1) + bpl +
+		    (1 << MERAM_BLOCK_SHIFT) - 1) >> MERAM_BLOCK_SHIFT;
+	pl->mcnf = (cfg->lines - 1) << MExxMCNF_BNM_SHIFT;
+	pl->bsize = ((height - 1) << MExxBSIZE_YSZM1_SHIFT) |
+		((bpl - 1) << MExxBSIZE_XSZM1_SHIFT);
+	pl->sbsize = stride;
+	pl->ctrl = ((block << MExxCTRL_MSAR_SHIFT) & MExxCTRL_MSAR_MASK) |
+		MExxCTRL_WD1 | MExxCTRL_WD0 | MExxCTRL_WS | MExxCTRL_CM |
+		(cfg->mode == MERAM_ICB_READ ?
+		 MExxCTRL_MD_READ : MExxCTRL_MD_WRITE);
+	return 0;
+}
+
+int meram_calc_layout(const struct meram_icb_config *cfgs, int n,
+	struct meram_layout *layout)
+{
+	int i, block = 0;
+
+	if (!cfgs || !layout || n < 1 || n > MERAM_MAX_PLANES)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		if (meram_calc_plane(&cfgs[i], block, &layout->plane[i]) < 0)
+			return -1;
+		block += layout->plane[i].size;
+	}
+	if (block > MERAM_MAX_BLOCKS)
+		return -1;
+	layout->n_planes = n;
+	layout->size = block;
+	return 0;
+}
+
+static int meram_write_plane(MERAM *meram, ICB *icb,
+	const struct meram_icb_config *cfg,
+	const struct meram_plane_layout *pl, int base)
+{
+	struct meram_reg_op ops[6];
+	int i;
+
+	/* the ICB is only enabled by the MExxCTRL write, so do that last */
+	ops[0].offset = MExxMCNF;
+	ops[0].val = pl->mcnf;
+	ops[1].offset = MExxBSIZE;
+	ops[1].val = pl->bsize;
+	ops[2].offset = MExxSBSIZE;
+	ops[2].val = pl->sbsize;
+	ops[3].offset = MExxSSARA;
+	ops[3].val = cfg->ssara;
+	ops[4].offset = MExxSSARB;
+	ops[4].val = cfg->ssarb;
+	ops[5].offset = MExxCTRL;
+	ops[5].val = (pl->ctrl & ~MExxCTRL_MSAR_MASK) |
+		(((base + pl->block) << MExxCTRL_MSAR_SHIFT) &
+		 MExxCTRL_MSAR_MASK);
+	for (i = 0; i < 6; i++)
+		ops[i].mask = 0;
+	if (meram_write_icb_batch(meram, icb, ops, 6) < 0)
+		return -1;
+
+	icb->config = *cfg;
+	icb->configured = 1;
+	return 0;
+}
+
+/* drop @icb from the planes sharing ICB memory, or drop its planes */
+void meram_icb_unlink_planes(ICB *icb)
+{
+	ICB **p, *plane, *next;
+
+	if (icb->plane_parent) {
+		for (p = &icb->plane_parent->plane_next; *p;
+		     p = &(*p)->plane_next) {
+			if (*p == icb) {
+				*p = icb->plane_next;
+				break;
+			}
+		}
+		icb->plane_parent = NULL;
+	} else {
+		for (plane = icb->plane_next; plane; plane = next) {
+			next = plane->plane_next;
+			plane->plane_parent = NULL;
+			plane->plane_next = NULL;
+		}
+	}
+	icb->plane_next = NULL;
+}
+
+int meram_configure_planes(MERAM *meram, ICB **icbs,
+	const struct meram_icb_config *cfgs, int n)
+{
+	struct meram_layout layout;
+	ICB *icb;
+	int i, j;
+
+	if (!meram || !icbs)
+		return -1;
+	if (meram_calc_layout(cfgs, n, &layout) < 0)
+		return -1;
+	/* an ICB listed twice would become its own next plane */
+	for (i = 0; i < n; i++) {
+		if (!icbs[i])
+			return -1;
+		for (j = 0; j < i; j++)
+			if (icbs[j] == icbs[i])
+				return -1;
+	}
+
+	/* the whole image lives in the memory of the first ICB */
+	icb = icbs[0];
+	for (i = 1; i < n; i++)
+		meram_free_icb_memory(meram, icbs[i]);
+	if (icb->mem_block < 0 || icb->mem_size < layout.size) {
+		meram_free_icb_memory(meram, icb);
+		if (meram_alloc_icb_memory(meram, icb, layout.size) < 0)
+			return -1;
+	}
+
+	for (i = 0; i < n; i++)
+		meram_icb_unlink_planes(icbs[i]);
+	for (i = n - 1; i > 0; i--) {
+		icbs[i]->plane_parent = icb;
+		icbs[i]->plane_block = layout.plane[i].block;
+		icbs[i]->plane_next = icb->plane_next;
+		icb->plane_next = icbs[i];
+	}
+	for (i = 0; i < n; i++)
+		if (meram_write_plane(meram, icbs[i], &cfgs[i],
+				      &layout.plane[i], icb->mem_block) < 0)
+			return -1;
+	return 0;
+}
+
+/* the configuration of @icb and its planes for @lines luma lines */
+static int meram_icb_planes(ICB *icb, int lines, ICB **icbs,
+	struct meram_icb_config *cfgs)
+{
+	ICB *plane;
+	int n = 0;
+
+	for (plane = icb; plane && n < MERAM_MAX_PLANES;
+	     plane = plane->plane_next) {
+		icbs[n] = plane;
+		cfgs[n] = plane->config;
+		/* keep the ratio between the planes, e.g. 2:1 for NV12 */
+		cfgs[n].lines = plane->config.lines * lines / icb->config.lines;
+		if (cfgs[n].lines < 1)
+			cfgs[n].lines = 1;
+		n++;
+	}
+	return n;
+}
+
+int meram_icb_plane_size(ICB *icb, int lines)
+{
+	struct meram_icb_config cfgs[MERAM_MAX_PLANES];
+	struct meram_layout layout;
+	ICB *icbs[MERAM_MAX_PLANES];
+	int n;
+
+	n = meram_icb_planes(icb, lines, icbs, cfgs);
+	if (meram_calc_layout(cfgs, n, &layout) < 0)
+		return -1;
+	return layout.size;
+}
+
+/*
+ * Change the number of lines cached by a configured ICB (and its
+ * planes) in place: the memory shrinks or grows at its end, under the
+ * tag of the handle that owns it. The first plane keeps its start
+ * block, but the start of every further plane follows the size of the
+ * planes before it, so e.g. the chroma of NV12 moves on every resize.
+ * Only to be used while the ICBs are idle.
+ */
+int meram_icb_resize(MERAM *meram, ICB *icb, int lines)
+{
+	struct meram_icb_config cfgs[MERAM_MAX_PLANES];
+	struct meram_layout layout;
+	ICB *icbs[MERAM_MAX_PLANES];
+	int i, n;
+
+	if (!icb->configured || icb->mem_block < 0)
+		return -1;
+	n = meram_icb_planes(icb, lines, icbs, cfgs);
+	if (meram_calc_layout(cfgs, n, &layout) < 0)
+		return -1;
+
+	if (layout.size > icb->mem_size) {
+		if (meram_shared_claim_blocks(meram->shared,
+				icb->mem_block + icb->mem_size,
+				layout.size - icb->mem_size, icb->mem_tag) < 0)
+			return -1;
+	} else if (layout.size < icb->mem_size) {
+		if (meram_shared_free_blocks(meram->shared,
+				icb->mem_block + layout.size,
+				icb->mem_size - layout.size, icb->mem_tag) < 0)
+			return -1;
+	}
+	icb->mem_size = layout.size;
+
+	for (i = 0; i < n; i++) {
+		icbs[i]->plane_block = layout.plane[i].block;
+		if (meram_write_plane(meram, icbs[i], &cfgs[i],
+				      &layout.plane[i], icb->mem_block) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+int meram_configure_icb(MERAM *meram, ICB *icb,
+	const struct meram_icb_config *cfg)
+{
+	return meram_configure_planes(meram, &icb, cfg, 1);
+}
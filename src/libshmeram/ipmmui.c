@@ -1,51 +1,93 @@
 #include <meram/meram.h>
 #include <meram/ipmmui.h>
+#include <limits.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <uiomux/uiomux.h>
 #include "meram_priv.h"
 
 typedef uint8_t u8;
 
-IPMMUI *ipmmui_open(void)
+/*
+ * The MERAM handle, the IPMMUI register window and the MEVCR1 enable bit
+ * are set up by the first IPMMUI handle of the process and shared by all
+ * of them, so later opens only copy pointers.
+ */
+static pthread_mutex_t ipmmui_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int ipmmui_refs;
+static struct IPMMUI ipmmui_common;
+
+static int ipmmui_common_open(void)
 {
-	IPMMUI *ipmmui;
-	MERAM_REG *reg;
+	struct IPMMUI *c = &ipmmui_common;
 	int ret;
-	unsigned long tmp;
 
-	ipmmui = calloc(1, sizeof(*ipmmui));
-
-	ipmmui->meram = meram_open();
-	if (ipmmui->meram == NULL)
-		return NULL;
+	c->meram = meram_open();
+	if (c->meram == NULL)
+		return -1;
+	c->uiomux = c->meram->uiomux;
 
-        reg = meram_lock_reg(ipmmui->meram);
-        meram_read_reg(ipmmui->meram, reg, MEVCR1, &tmp);
-        meram_write_reg(ipmmui->meram, reg, MEVCR1, tmp | 0x20000000);
-        meram_unlock_reg(ipmmui->meram, reg);
+	ret = meram_backend->get_mmio(c->uiomux, UIOMUX_SH_IPMMUI,
+		&c->paddr,
+		&c->len,
+		&c->vaddr);
+	/* only enable the IPMMUI once it can actually be used */
+	if (!ret || meram_set_reg_bits(c->meram, MEVCR1, 0x20000000) < 0) {
+		meram_close(c->meram);
+		memset(c, 0, sizeof(*c));
+		return -1;
+	}
+	MERAM_TRACE_WINDOW(c->vaddr, c->len, c->paddr);
+	return 0;
+}
 
-	ipmmui->uiomux = ipmmui->meram->uiomux;
+IPMMUI *ipmmui_open(void)
+{
+	IPMMUI *ipmmui;
 
-	ret = uiomux_get_mmio(ipmmui->uiomux, UIOMUX_SH_IPMMUI,
-		&ipmmui->paddr,
-		&ipmmui->len,
-		&ipmmui->vaddr);
+	ipmmui = calloc(1, sizeof(*ipmmui));
+	if (!ipmmui)
+		return NULL;
 
-	if (!ret) {
-		meram_close(ipmmui->meram);
+	pthread_mutex_lock(&ipmmui_mutex);
+	if (ipmmui_refs == 0 && ipmmui_common_open() < 0) {
+		pthread_mutex_unlock(&ipmmui_mutex);
+		free(ipmmui);
 		return NULL;
 	}
+	ipmmui_refs++;
+	ipmmui->meram = ipmmui_common.meram;
+	ipmmui->uiomux = ipmmui_common.uiomux;
+	ipmmui->paddr = ipmmui_common.paddr;
+	ipmmui->len = ipmmui_common.len;
+	ipmmui->vaddr = ipmmui_common.vaddr;
+	pthread_mutex_unlock(&ipmmui_mutex);
 	return ipmmui;
 }
 
 void ipmmui_close(IPMMUI *ipmmui)
 {
+	int i;
+
 	if (!ipmmui)
 		return;
-	meram_close(ipmmui->meram);
+	/* do not leave the next owner of a PMB a live translation */
+	for (i = 0; i < IPMMUI_PMB_COUNT; i++)
+		if (ipmmui->pmb[i].mapped)
+			ipmmui_unmap(ipmmui, &ipmmui->pmb[i]);
+		else if (ipmmui->pmb[i].locked)
+			ipmmui_unlock_pmb(ipmmui, &ipmmui->pmb[i]);
+
+	/* MEVCR1 is left enabled, other processes may be using the IPMMUI */
+	pthread_mutex_lock(&ipmmui_mutex);
+	if (--ipmmui_refs == 0) {
+		meram_close(ipmmui_common.meram);
+		memset(&ipmmui_common, 0, sizeof(ipmmui_common));
+	}
+	pthread_mutex_unlock(&ipmmui_mutex);
 	free(ipmmui);
 }
 
@@ -55,98 +97,289 @@ ipmmui_get_vaddr(IPMMUI *ipmmui,
 		 unsigned long *vaddr,
 		 int *size)
 {
-	struct ipmmui_settings *current;
-	if (!ipmmui)
+	return ipmmui_get_tag_vaddr(ipmmui, ipmmui_get_tag(ipmmui, tag),
+				    vaddr, size);
+}
+
+int ipmmui_get_tag(IPMMUI *ipmmui, const char *tag)
+{
+	if (!ipmmui || !tag)
 		return -1;
-	current = ipmmui->meram->ipmmui_config;
-	while (current) {
-		if (!strcmp(current->tag, tag)) {
-			*vaddr = current->vaddr;
-			*size = current->size;
-			return 0;
-		}
-		current = current->next;
-	}
-	return -1;
+	return meram_config_find_ipmmui(tag);
 }
-PMB *ipmmui_lock_pmb(IPMMUI *ipmmui, int index)
+
+int ipmmui_get_tag_vaddr(IPMMUI *ipmmui, int tag, unsigned long *vaddr,
+			 int *size)
 {
-	PMB *pmb;
-	pmb = calloc (1, sizeof (*pmb));
+	const struct meram_config *cfg;
+
+	if (!ipmmui || tag < 0)
+		return -1;
+	cfg = meram_config_get();
+	if (tag >= cfg->n_ipmmui)
+		return -1;
+	*vaddr = cfg->ipmmui[tag].vaddr;
+	*size = cfg->ipmmui[tag].size;
+	return 0;
+}
+
+static PMB *ipmmui_pmb_handle(IPMMUI *ipmmui, int index)
+{
+	PMB *pmb = &ipmmui->pmb[index];
+
 	pmb->index = index;
 	pmb->offset = 0x80 + 4 * index;
+	pmb->locked = 1;
 	return pmb;
 }
 
+/*
+ * A PMB handle only owns its IMPMBA and IMPMBD registers. The entries
+ * are 4 bytes apart, so any other offset reaches the registers of
+ * another entry.
+ */
+static int ipmmui_pmb_offset_valid(int offset)
+{
+	return offset == IMPMBA || offset == IMPMBD;
+}
+
+static int ipmmui_pmb_check_batch(const struct meram_reg_op *ops, int n)
+{
+	int i;
+
+	if (!ops || n < 0)
+		return -1;
+	for (i = 0; i < n; i++)
+		if (!ipmmui_pmb_offset_valid(ops[i].offset))
+			return -1;
+	return 0;
+}
+
+PMB *ipmmui_lock_pmb(IPMMUI *ipmmui, int index)
+{
+	if (!ipmmui || index < 0 || index >= IPMMUI_PMB_COUNT)
+		return NULL;
+	if (meram_shared_claim_pmb(ipmmui->meram->shared, index) < 0)
+		return NULL;
+	return ipmmui_pmb_handle(ipmmui, index);
+}
+
 void ipmmui_unlock_pmb(IPMMUI *ipmmui, PMB *pmb)
 {
-	free(pmb);
+	if (!ipmmui || !pmb || !pmb->locked)
+		return;
+	pmb->locked = 0;
+	pmb->mapped = 0;
+	meram_shared_release_pmb(ipmmui->meram->shared, pmb->index);
+}
+
+/*
+ * PMB page sizes and their IMPMBD size field, as in the SH-4A PMB.
+ * Both the virtual and the physical page are aligned to the page size.
+ */
+#define PMB_V		0x100
+
+static const struct {
+	unsigned long size;
+	unsigned long sz;
+} pmb_sizes[] = {
+	{ 16UL << 20, 0x00 },
+	{ 64UL << 20, 0x10 },
+	{ 128UL << 20, 0x80 },
+	{ 512UL << 20, 0x90 },
+};
+
+#define N_PMB_SIZES	(sizeof(pmb_sizes) / sizeof(pmb_sizes[0]))
+
+PMB *ipmmui_map(IPMMUI *ipmmui, unsigned long paddr, unsigned long size,
+		unsigned long *vaddr)
+{
+	unsigned long page, window = 0;
+	PMB *pmb;
+	int index;
+	unsigned int i;
+
+	if (!ipmmui || !size || !vaddr)
+		return NULL;
+	if (size > ULONG_MAX - paddr)
+		return NULL;
+
+	/* the smallest page that covers the buffer from its aligned start */
+	for (i = 0; i < N_PMB_SIZES; i++) {
+		page = paddr & ~(pmb_sizes[i].size - 1);
+		if (paddr + size - page <= pmb_sizes[i].size)
+			break;
+	}
+	if (i == N_PMB_SIZES)
+		return NULL;
+
+	index = meram_shared_alloc_pmb(ipmmui->meram->shared);
+	if (index < 0)
+		return NULL;
+	pmb = ipmmui_pmb_handle(ipmmui, index);
+	window = meram_shared_map_pmb(ipmmui->meram->shared, index,
+		pmb_sizes[i].size, IPMMUI_VA_START, IPMMUI_VA_END);
+	if (!window) {
+		ipmmui_unlock_pmb(ipmmui, pmb);
+		return NULL;
+	}
+
+	/* invalidate the entry while it is being changed */
+	ipmmui_write_pmb(ipmmui, pmb, IMPMBA, 0);
+	ipmmui_write_pmb(ipmmui, pmb, IMPMBD, (page & 0xff000000) |
+			 pmb_sizes[i].sz | PMB_V);
+	ipmmui_write_pmb(ipmmui, pmb, IMPMBA, (window & 0xff000000) | PMB_V);
+	pmb->mapped = 1;
+	*vaddr = window + (paddr - page);
+	return pmb;
+}
+
+void ipmmui_unmap(IPMMUI *ipmmui, PMB *pmb)
+{
+	if (!ipmmui || !pmb || !pmb->locked)
+		return;
+	ipmmui_write_pmb(ipmmui, pmb, IMPMBA, 0);
+	ipmmui_write_pmb(ipmmui, pmb, IMPMBD, 0);
+	ipmmui_unlock_pmb(ipmmui, pmb);
 }
 
 IPMMUI_REG *ipmmui_lock_reg(IPMMUI *ipmmui)
 {
+	uint64_t start = MERAM_TRACE_NOW();
 	IPMMUI_REG *ipmmui_reg;
 	if (!ipmmui)
 		return NULL;
 
-	ipmmui_reg = calloc (1, sizeof (*ipmmui_reg));
+	if (meram_backend->lock(ipmmui->uiomux, UIOMUX_SH_IPMMUI) < 0)
+		return NULL;
+	MERAM_TRACE_SPAN(MERAM_TRACE_REG_WAIT, start, UIOMUX_SH_IPMMUI, 0);
+
+	ipmmui_reg = &ipmmui->reg;
 	/*offset and size determination*/
 	ipmmui_reg->offset = 0;
-	ipmmui_reg->len = 0x24;
-
-	uiomux_lock(ipmmui->uiomux, UIOMUX_SH_IPMMUI);
+	ipmmui_reg->len = IPMMUI_REG_LEN;
+	ipmmui_reg->locked = 1;
+	ipmmui_reg->trace_ts = MERAM_TRACE_NOW();
 
-	return ipmmui_reg; //* or NULL on locking error*/
+	return ipmmui_reg;
 }
 
 void ipmmui_unlock_reg(IPMMUI *ipmmui, IPMMUI_REG *ipmmui_reg)
 {
-	if (!ipmmui)
+	if (!ipmmui || !ipmmui_reg)
 		return;
-	uiomux_unlock(ipmmui->uiomux, UIOMUX_SH_IPMMUI);
-	free(ipmmui_reg);
+	ipmmui_reg->locked = 0;
+	MERAM_TRACE_SPAN(MERAM_TRACE_REG_HOLD, ipmmui_reg->trace_ts,
+			 UIOMUX_SH_IPMMUI, 0);
+	meram_backend->unlock(ipmmui->uiomux, UIOMUX_SH_IPMMUI);
+}
+int ipmmui_update_reg(IPMMUI *ipmmui, int offset, unsigned long mask,
+		unsigned long val)
+{
+	struct meram_reg_op op = { offset, mask, val };
+	uint64_t start = MERAM_TRACE_NOW(), held;
+
+	if (!ipmmui || !mask ||
+	    meram_reg_check_batch(IPMMUI_REG_LEN, &op, 1) < 0)
+		return -1;
+
+	if (meram_backend->lock(ipmmui->uiomux, UIOMUX_SH_IPMMUI) < 0)
+		return -1;
+	MERAM_TRACE_SPAN(MERAM_TRACE_REG_WAIT, start, UIOMUX_SH_IPMMUI, 0);
+	held = MERAM_TRACE_NOW();
+	meram_reg_write_batch(ipmmui->vaddr, IPMMUI_REG_LEN, &op, 1);
+	MERAM_TRACE_SPAN(MERAM_TRACE_REG_HOLD, held, UIOMUX_SH_IPMMUI, 0);
+	meram_backend->unlock(ipmmui->uiomux, UIOMUX_SH_IPMMUI);
+	return 0;
+}
+
+int ipmmui_set_reg_bits(IPMMUI *ipmmui, int offset, unsigned long bits)
+{
+	return ipmmui_update_reg(ipmmui, offset, bits, bits);
 }
+
+int ipmmui_clear_reg_bits(IPMMUI *ipmmui, int offset, unsigned long bits)
+{
+	return ipmmui_update_reg(ipmmui, offset, bits, 0);
+}
+
 int ipmmui_read_pmb(IPMMUI *ipmmui, PMB *pmb, int offset,
 		unsigned long *read_val)
 {
-	volatile unsigned long *reg;
-	if (!ipmmui || !pmb)
+	volatile uint32_t *reg;
+	if (!ipmmui || !pmb || !ipmmui_pmb_offset_valid(offset))
 		return -1;
-	reg = (unsigned long *) ((u8 *) ipmmui->vaddr + pmb->offset + offset);
+	reg = (uint32_t *) ((u8 *) ipmmui->vaddr + pmb->offset + offset);
 	*read_val = *reg;
+	MERAM_TRACE_MMIO(MERAM_TRACE_MMIO_READ, reg, *read_val);
 	return 0;
 }
 int ipmmui_write_pmb(IPMMUI *ipmmui, PMB *pmb, int offset, unsigned long val)
 {
-	volatile unsigned long *reg;
-	if (!ipmmui || !pmb)
+	volatile uint32_t *reg;
+	if (!ipmmui || !pmb || !ipmmui_pmb_offset_valid(offset))
 		return -1;
-	reg = (unsigned long *) ((u8 *) ipmmui->vaddr + pmb->offset + offset);
+	reg = (uint32_t *) ((u8 *) ipmmui->vaddr + pmb->offset + offset);
 	*reg = val;
+	MERAM_TRACE_MMIO(MERAM_TRACE_MMIO_WRITE, reg, val);
 	return 0;
 }
 int ipmmui_read_reg(IPMMUI *ipmmui, IPMMUI_REG *ipmmui_reg, int offset,
 		unsigned long *read_val)
 {
-	volatile unsigned long *reg;
+	volatile uint32_t *reg;
 	if (!ipmmui || !ipmmui_reg)
 		return -1;
 
-	reg = (unsigned long *) ((u8 *) ipmmui->vaddr + ipmmui_reg->offset +
+	reg = (uint32_t *) ((u8 *) ipmmui->vaddr + ipmmui_reg->offset +
 		offset);
 	*read_val = *reg;
+	MERAM_TRACE_MMIO(MERAM_TRACE_MMIO_READ, reg, *read_val);
 	return 0;
 }
 int ipmmui_write_reg(IPMMUI *ipmmui, IPMMUI_REG *ipmmui_reg, int offset,
 		unsigned long val)
 {
-	volatile unsigned long *reg;
+	volatile uint32_t *reg;
 	if (!ipmmui || !ipmmui_reg)
 		return -1;
 
-        reg = (unsigned long *) ((u8 *) ipmmui->vaddr +
+        reg = (uint32_t *) ((u8 *) ipmmui->vaddr +
 		ipmmui_reg->offset + offset);
 
 	*reg = val;
+	MERAM_TRACE_MMIO(MERAM_TRACE_MMIO_WRITE, reg, val);
 	return 0;
 }
+int ipmmui_write_pmb_batch(IPMMUI *ipmmui, PMB *pmb,
+		const struct meram_reg_op *ops, int n)
+{
+	if (!ipmmui || !pmb || ipmmui_pmb_check_batch(ops, n) < 0)
+		return -1;
+	return meram_reg_write_batch((u8 *) ipmmui->vaddr + pmb->offset,
+		IMPMBD + 4, ops, n);
+}
+int ipmmui_read_pmb_batch(IPMMUI *ipmmui, PMB *pmb,
+		struct meram_reg_op *ops, int n)
+{
+	if (!ipmmui || !pmb || ipmmui_pmb_check_batch(ops, n) < 0)
+		return -1;
+	return meram_reg_read_batch((u8 *) ipmmui->vaddr + pmb->offset,
+		IMPMBD + 4, ops, n);
+}
+int ipmmui_write_reg_batch(IPMMUI *ipmmui, IPMMUI_REG *ipmmui_reg,
+		const struct meram_reg_op *ops, int n)
+{
+	if (!ipmmui || !ipmmui_reg)
+		return -1;
+	return meram_reg_write_batch((u8 *) ipmmui->vaddr + ipmmui_reg->offset,
+		ipmmui_reg->len, ops, n);
+}
+int ipmmui_read_reg_batch(IPMMUI *ipmmui, IPMMUI_REG *ipmmui_reg,
+		struct meram_reg_op *ops, int n)
+{
+	if (!ipmmui || !ipmmui_reg)
+		return -1;
+	return meram_reg_read_batch((u8 *) ipmmui->vaddr + ipmmui_reg->offset,
+		ipmmui_reg->len, ops, n);
+}
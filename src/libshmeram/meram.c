@@ -1,10 +1,12 @@
 #include <meram/meram.h>
+#include <errno.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <uiomux/uiomux.h>
 #include <stdint.h>
+#include <time.h>
 #include "meram_priv.h"
 
 #define ALIGN2UP(_p, _w)		\
@@ -20,15 +22,22 @@
 
 typedef uint8_t u8;
 
-static UIOMux *uiomux = NULL;
+static void *uiomux = NULL;
 static pthread_mutex_t uiomux_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-static unsigned long icb_inuse[(MAX_ICB_INDEX + 1) >> 5];
-static pthread_mutex_t icb_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t icb_wq = PTHREAD_COND_INITIALIZER;
-
 static int ref_count = 0;
 
+/* tags the blocks allocated through a handle, so close can free them */
+static uint32_t next_tag = 0;
+
+static struct meram_shared *shared = NULL;
+
+/*
+ * ICB handles. An index can only be claimed by one owner at a time, so
+ * each ICB has exactly one handle and locking never allocates.
+ */
+static ICB icb_pool[MAX_ICB_INDEX + 1];
+
 static const char *uios[] = {
 	"MERAM",
 	"IPMMU",
@@ -39,19 +48,16 @@ MERAM *meram_open(void)
 {
 	MERAM *meram;
 	int ret;
-	static struct reserved_address *reserved_mem;
-	static struct ipmmui_settings *ipmmui_config;
 
 	meram = calloc(1, sizeof(*meram));
 	if (!meram)
 		return NULL;
+	pthread_mutex_init(&meram->arena_mutex, NULL);
 
 	pthread_mutex_lock(&uiomux_mutex);
 	ref_count++;
-	if (uiomux == NULL) {
-		uiomux = uiomux_open_named(uios);
-		parse_config_file(CONFIG_FILE, &reserved_mem, &ipmmui_config);
-	}
+	if (uiomux == NULL)
+		uiomux = meram_backend->open(uios);
 	pthread_mutex_unlock(&uiomux_mutex);
 
 	if (!uiomux) {
@@ -59,19 +65,19 @@ MERAM *meram_open(void)
 		return NULL;
 	}
 	meram->uiomux = uiomux;
-	ret = uiomux_get_mmio(uiomux, UIOMUX_SH_MERAM,
+	ret = meram_backend->get_mmio(uiomux, UIOMUX_SH_MERAM,
 		&meram->paddr,
 		&meram->len,
 		&meram->vaddr);
 
-	ret &= uiomux_get_mem(uiomux, UIOMUX_SH_MERAM,
+	ret &= meram_backend->get_mem(uiomux, UIOMUX_SH_MERAM,
 		&meram->mem_paddr,
 		&meram->mem_len,
 		&meram->mem_vaddr);
 	if (!ret) {
 		pthread_mutex_lock(&uiomux_mutex);
 		if (ref_count == 1) {
-			uiomux_close(uiomux);
+			meram_backend->close(uiomux);
 			uiomux = NULL;
 		}
 		pthread_mutex_unlock(&uiomux_mutex);
@@ -79,52 +85,59 @@ MERAM *meram_open(void)
 		free(meram);
 		return NULL;
 	}
-	meram->reserved_mem = reserved_mem;
-	meram->ipmmui_config = ipmmui_config;
+	MERAM_TRACE_WINDOW(meram->vaddr, meram->len, meram->paddr);
+	do {
+		meram->tag = __atomic_add_fetch(&next_tag, 1, __ATOMIC_RELAXED);
+	} while (!meram->tag);
+
+	/*
+	 * reserved regions are taken out when the shared state is set up,
+	 * and brought in line with meram.conf when a later attach finds
+	 * that the file changed
+	 */
+	pthread_mutex_lock(&uiomux_mutex);
+	if (!shared)
+		shared = meram_shared_attach(
+			meram->mem_len >> MERAM_BLOCK_SHIFT);
+	meram->shared = shared;
+	pthread_mutex_unlock(&uiomux_mutex);
+	if (!meram->shared) {
+		meram_close(meram);
+		return NULL;
+	}
 	return meram;
 }
 
 void meram_close(MERAM *meram)
 {
+	/* background jobs may still be using the handle */
+	meram_async_drain(meram);
+	meram_arena_close_all(meram);
+	if (meram->shared)
+		meram_shared_free_tag(meram->shared, meram->tag);
+
 	pthread_mutex_lock(&uiomux_mutex);
 	ref_count--;
 	if (ref_count == 0) {
-		uiomux_close(uiomux);
+		meram_async_shutdown();
+		meram_backend->close(uiomux);
 		uiomux = NULL;
-		delete_reserved_addr_list(meram->reserved_mem);
-		meram->reserved_mem = NULL;
-		delete_ipmmui_settings(meram->ipmmui_config);
-		meram->ipmmui_config = NULL;
+		meram_shared_detach(shared);
+		shared = NULL;
 	}
 	pthread_mutex_unlock(&uiomux_mutex);
+	pthread_mutex_destroy(&meram->arena_mutex);
 	free(meram);
 }
 
-static inline ICB *__meram_lock_icb(MERAM *meram, int index, int sync)
+/* set up the handle for an ICB that has just been claimed */
+static ICB *meram_icb_handle(MERAM *meram, int index)
 {
 	ICB *icb;
         int pagesize = sysconf(_SC_PAGESIZE);
-	unsigned long mask;
-	int slot, ret;
-
-	if ((index < 0) || (index > MAX_ICB_INDEX))
-		return NULL;
-
-	/* wait until the target icb is available */
-	slot = index >> 5;
-	mask = 1UL << (index & 31);
-	pthread_mutex_lock(&icb_mutex);
-	while (icb_inuse[slot] & mask) {
-		if (!sync) {
-			pthread_mutex_unlock(&icb_mutex);
-			return NULL;
-		}
-		pthread_cond_wait(&icb_wq, &icb_mutex);
-	}
-	icb_inuse[slot] |= mask;
-	pthread_mutex_unlock(&icb_mutex);
 
-	icb = calloc (1, sizeof (*icb));
+	icb = &icb_pool[index];
+	memset(icb, 0, sizeof(*icb));
 	/*lock indeces 1 per icb positioned after memory pages*/
 	icb->lock_offset = ((meram->mem_len + pagesize - 1 )/pagesize) + index;
 	/*offset and size determination*/
@@ -132,166 +145,247 @@ static inline ICB *__meram_lock_icb(MERAM *meram, int index, int sync)
 	icb->len = 0x20;
 	icb->index = index;
 	icb->mem_block = icb->mem_size = -1;
+	/* the control register holds status and flush request bits */
+	icb->shadow.nocache = 1U << (MExxCTRL >> 2);
 #ifdef EXPERIMENTAL
-	if (uiomux_partial_lock(meram->uiomux, UIOMUX_SH_MERAM,
+	if (meram_backend->partial_lock(meram->uiomux, UIOMUX_SH_MERAM,
 		icb->lock_offset, icb->len) < 0) {
-		free (icb);
+		meram_shared_unlock_icb(meram->shared, index);
 		return NULL;
 	}
 #endif
 	icb->locked = 1;
+	icb->trace_ts = MERAM_TRACE_NOW();
 	return icb;
 }
 
+static inline ICB *__meram_lock_icb(MERAM *meram, int index,
+	const struct timespec *deadline, int sync)
+{
+	uint64_t start = MERAM_TRACE_NOW();
+	int ret;
+
+	if ((index < 0) || (index > MAX_ICB_INDEX))
+		return NULL;
+
+	/* wait until the target icb is available */
+	ret = meram_shared_lock_icb(meram->shared, index, deadline, sync);
+	MERAM_TRACE_SPAN(MERAM_TRACE_ICB_WAIT, start, index, ret);
+	if (ret < 0) {
+		if (ret == -ETIMEDOUT)
+			errno = ETIMEDOUT;
+		return NULL;
+	}
+	return meram_icb_handle(meram, index);
+}
+
 ICB *meram_lock_icb(MERAM *meram, int index)
 {
-	return __meram_lock_icb(meram, index, 1);
+	return __meram_lock_icb(meram, index, NULL, 1);
 }
 
 ICB *meram_trylock_icb(MERAM *meram, int index)
 {
-	return __meram_lock_icb(meram, index, 0);
+	return __meram_lock_icb(meram, index, NULL, 0);
+}
+
+ICB *meram_timedlock_icb(MERAM *meram, int index,
+	const struct timespec *deadline)
+{
+	if (!deadline) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return __meram_lock_icb(meram, index, deadline, 1);
+}
+
+ICB *meram_lock_any_icb(MERAM *meram, int lo, int hi, int timeout_ms)
+{
+	uint64_t start = MERAM_TRACE_NOW();
+	struct timespec deadline;
+	int index;
+
+	if (!meram || lo < 0 || hi > MAX_ICB_INDEX || lo > hi)
+		return NULL;
+
+	if (timeout_ms > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+	index = meram_shared_lock_any_icb(meram->shared, lo, hi,
+		timeout_ms > 0 ? &deadline : NULL, timeout_ms != 0);
+	/* a failed wait is recorded against the first ICB of the range */
+	MERAM_TRACE_SPAN(MERAM_TRACE_ICB_WAIT, start, index < 0 ? lo : index,
+		index < 0 ? index : 0);
+	if (index < 0) {
+		if (index == -ETIMEDOUT)
+			errno = ETIMEDOUT;
+		return NULL;
+	}
+	return meram_icb_handle(meram, index);
+}
+
+int meram_get_icb_index(ICB *icb)
+{
+	if (!icb)
+		return -1;
+	return icb->index;
 }
 
 void meram_unlock_icb(MERAM *meram, ICB *icb)
 {
-	int index = icb->index & 31;
-	int slot = icb->index >> 5;
+	int index = icb->index;
 
 	/*partial uiomux unlock*/
 #ifdef EXPERIMENTAL
-	uiomux_partial_unlock(meram->uiomux, UIOMUX_SH_MERAM,
+	meram_backend->partial_unlock(meram->uiomux, UIOMUX_SH_MERAM,
 		icb->lock_offset, icb->len);
 #endif
 	icb->locked = 0;
+	meram_icb_unlink_planes(icb);
 	meram_free_icb_memory(meram, icb);
-	free(icb);
 
-	pthread_mutex_lock(&icb_mutex);
-	icb_inuse[slot] &= ~(1UL << index);
-	pthread_cond_broadcast(&icb_wq);
-	pthread_mutex_unlock(&icb_mutex);
+	MERAM_TRACE_SPAN(MERAM_TRACE_ICB_HOLD, icb->trace_ts, index, 0);
+	meram_shared_unlock_icb(meram->shared, index);
 }
 
 MERAM_REG *meram_lock_reg(MERAM *meram)
 {
+	uint64_t start = MERAM_TRACE_NOW();
 	MERAM_REG *meram_reg;
 
-	meram_reg = calloc (1, sizeof (MERAM_REG));
+	if (!meram)
+		return NULL;
+	if (meram_backend->lock(meram->uiomux, UIOMUX_SH_MERAM) < 0)
+		return NULL;
+	MERAM_TRACE_SPAN(MERAM_TRACE_REG_WAIT, start, UIOMUX_SH_MERAM, 0);
+
+	/* the handle is only ever used by the holder of the lock */
+	meram_reg = &meram->reg;
+	memset(meram_reg, 0, sizeof(*meram_reg));
 	/*offset and size determination*/
 	meram_reg->offset = 0;
-	meram_reg->len = 0x80;
-
-	uiomux_lock(meram->uiomux, UIOMUX_SH_MERAM);
+	meram_reg->len = MERAM_REG_LEN;
+	/* MEACTS starts actions, a write must always reach the hardware */
+	meram_reg->shadow.nocache = 1U << (MEACTS >> 2);
+	meram_reg->locked = 1;
+	meram_reg->trace_ts = MERAM_TRACE_NOW();
 
-	return meram_reg; //* or NULL on locking error*/
+	return meram_reg;
 }
 void meram_unlock_reg(MERAM *meram, MERAM_REG *meram_reg)
 {
-	uiomux_unlock(meram->uiomux, UIOMUX_SH_MERAM);
-	free(meram_reg);
+	if (!meram || !meram_reg)
+		return;
+	meram_reg->locked = 0;
+	MERAM_TRACE_SPAN(MERAM_TRACE_REG_HOLD, meram_reg->trace_ts,
+			 UIOMUX_SH_MERAM, 0);
+	meram_backend->unlock(meram->uiomux, UIOMUX_SH_MERAM);
+}
+
+int meram_update_reg(MERAM *meram, int offset, unsigned long mask,
+		unsigned long val)
+{
+	struct meram_reg_op op = { offset, mask, val };
+	uint64_t start = MERAM_TRACE_NOW(), held;
+
+	if (!meram || !mask ||
+	    meram_reg_check_batch(MERAM_REG_LEN, &op, 1) < 0)
+		return -1;
+
+	/* everything is checked up front to keep the lock hold short */
+	if (meram_backend->lock(meram->uiomux, UIOMUX_SH_MERAM) < 0)
+		return -1;
+	MERAM_TRACE_SPAN(MERAM_TRACE_REG_WAIT, start, UIOMUX_SH_MERAM, 0);
+	held = MERAM_TRACE_NOW();
+	meram_reg_write_batch(meram->vaddr, MERAM_REG_LEN, &op, 1);
+	MERAM_TRACE_SPAN(MERAM_TRACE_REG_HOLD, held, UIOMUX_SH_MERAM, 0);
+	meram_backend->unlock(meram->uiomux, UIOMUX_SH_MERAM);
+	return 0;
+}
+
+int meram_set_reg_bits(MERAM *meram, int offset, unsigned long bits)
+{
+	return meram_update_reg(meram, offset, bits, bits);
+}
+
+int meram_clear_reg_bits(MERAM *meram, int offset, unsigned long bits)
+{
+	return meram_update_reg(meram, offset, bits, 0);
+}
+
+/* convert a byte offset and a size in blocks to a block range */
+static int meram_block_range(MERAM *meram, int offset, int size,
+	int *start, int *count)
+{
+	unsigned long end = offset + ((unsigned long) size << MERAM_BLOCK_SHIFT);
+
+	if (offset < 0 || size <= 0 || end > meram->mem_len)
+		return -1;
+	*start = offset >> MERAM_BLOCK_SHIFT;
+	*count = ((end + (1 << MERAM_BLOCK_SHIFT) - 1) >> MERAM_BLOCK_SHIFT) -
+		*start;
+	return 0;
 }
 
 int meram_lock_memory_block(MERAM *meram, int offset, int size)
 {
-	int alloc_size = size << 10;
-	void *alloc_ptr = (u8 *) meram->mem_vaddr + offset;
-	struct reserved_address *current;
-
-	/* check if specified blocks would overlap reserved regions */
-	current = meram->reserved_mem;
-	while (current) {
-		unsigned long alloc_beg = (unsigned long)
-			((u8 *) alloc_ptr - (u8 *) meram->mem_vaddr);
-		unsigned long alloc_end = alloc_beg + alloc_size -
-			(1 << 10);
-		unsigned long cur_beg = current->start_block << 10;
-		unsigned long cur_end = current->end_block << 10;
-
-		if (alloc_beg > cur_end ) {
-			current = current->next;
-			continue;
-		}
-		if ((alloc_end) < cur_beg) {
-			current = current->next;
-			continue;
-		}
+	int start, count;
+
+	if (meram_block_range(meram, offset, size, &start, &count) < 0)
 		return -1;
-	}
 
-	return uiomux_mlock(meram->uiomux, UIOMUX_SH_MERAM, alloc_ptr, alloc_size);
+	/* turn reserved ranges down without taking the shared lock */
+	if (meram_config_reserved_overlap(start, count) >= 0)
+		return -1;
+	return meram_shared_claim_blocks(meram->shared, start, count,
+		meram->tag);
 }
 
 void meram_unlock_memory_block(MERAM *meram, int offset, int size)
 {
-	int alloc_size = size << 10;
-	void *alloc_ptr = (u8 *) meram->mem_vaddr + offset;
-	uiomux_munlock(meram->uiomux, UIOMUX_SH_MERAM, alloc_ptr, alloc_size);
+	int start, count;
+
+	if (meram_block_range(meram, offset, size, &start, &count) < 0)
+		return;
+	meram_shared_free_blocks(meram->shared, start, count, meram->tag);
 }
 
 int meram_alloc_memory_block(MERAM *meram, int size)
 {
-	int alloc_size = size << 10;
-	void *alloc_ptr = NULL;
-	struct reserved_address *current;
-	current = meram->reserved_mem;
-	/* uiomux_malloc has minimum 1 page (4k) alignment*/
-	while (!alloc_ptr) {
-		alloc_ptr = uiomux_malloc(meram->uiomux, UIOMUX_SH_MERAM,
-			alloc_size, alloc_size);
-		if (!alloc_ptr)
-			return -1;
-		current = meram->reserved_mem;
-		while (current) {
-			unsigned long alloc_beg = (unsigned long)
-				((u8 *) alloc_ptr - (u8 *) meram->mem_vaddr);
-			unsigned long alloc_end = alloc_beg + alloc_size -
-				(1 << 10);
-			unsigned long cur_beg = current->start_block << 10;
-			unsigned long cur_end = current->end_block << 10;
-			if (alloc_beg > cur_end ) {
-				current = current->next;
-				continue;
-			}
-			if ((alloc_end) < cur_beg) {
-				current = current->next;
-				continue;
-			}
-			if (alloc_beg < cur_beg) {
-				uiomux_free(meram->uiomux, UIOMUX_SH_MERAM,
-					alloc_ptr,
-					cur_beg - alloc_beg);
-			}
-			if (alloc_end > cur_end) {
-				uiomux_free(meram->uiomux, UIOMUX_SH_MERAM,
-					(u8 *)meram->mem_vaddr + cur_end +
-					(1 << 10), alloc_end - cur_end);
-			}
-			alloc_ptr = NULL;
-			break;
-		}
-	}
-
-	return ((unsigned long) ((u8 *)alloc_ptr -
-			(u8 *)meram->mem_vaddr)) >> 10;
+	if (!meram || size <= 0)
+		return -1;
+	return meram_shared_alloc_blocks(meram->shared, size, meram->tag);
 }
-void meram_free_memory_block(MERAM *meram, int offset, int size)
+
+int meram_alloc_memory_block_zeroed(MERAM *meram, int size)
 {
-	int alloc_size = size << 10;
-	void *alloc_ptr = (u8 *) meram->mem_vaddr + (offset << 10);
-	uiomux_free(meram->uiomux, UIOMUX_SH_MERAM, alloc_ptr, alloc_size);
+	int offset = meram_alloc_memory_block(meram, size);
+
+	/* clearing is left to the allocation that asks for it */
+	if (offset >= 0)
+		meram_fill_memory_pattern(meram, offset, size, 0, 64);
+	return offset;
 }
 
-void meram_fill_memory_block(MERAM *meram, int offset,
-			     int n_blocks, unsigned int val)
+int meram_get_stats(MERAM *meram, struct meram_stats *stats)
 {
-	unsigned int bytes = n_blocks << 10;
-	unsigned long *ptr32 = (unsigned long *)
-		((u8 *) meram->mem_vaddr + (offset << 10));
-	unsigned int i;
+	if (!meram || !stats)
+		return -1;
+	meram_shared_get_stats(meram->shared, stats);
+	return 0;
+}
 
-	for (i=0; i< bytes/sizeof(unsigned long); i++)
-		*(ptr32 + i) = val;
+void meram_free_memory_block(MERAM *meram, int offset, int size)
+{
+	if (!meram)
+		return;
+	meram_shared_free_blocks(meram->shared, offset, size, meram->tag);
 }
 
 int meram_alloc_icb_memory(MERAM *meram, ICB *icb, int size)
@@ -299,8 +393,10 @@ int meram_alloc_icb_memory(MERAM *meram, ICB *icb, int size)
 	if (!meram || !icb)
 		return -1;
 	icb->mem_block = meram_alloc_memory_block(meram, size);
-	if (icb->mem_block >= 0)
+	if (icb->mem_block >= 0) {
 		icb->mem_size = size;
+		icb->mem_tag = meram->tag;
+	}
 	return icb->mem_block;
 }
 
@@ -308,165 +404,212 @@ void meram_free_icb_memory(MERAM *meram, ICB *icb)
 {
 	if (!meram || !icb || icb->mem_block < 0 || icb->mem_size < 0)
 		return;
-	meram_free_memory_block(meram, icb->mem_block, icb->mem_size);
+	/* the memory may have been allocated through another handle */
+	meram_shared_free_blocks(meram->shared, icb->mem_block, icb->mem_size,
+		icb->mem_tag);
 	icb->mem_block = icb->mem_size = -1;
 }
 
+/*
+ * Register accesses through the shadow copy of a register block. The
+ * shadow only lives as long as the lock on the block is held, so it
+ * starts out empty on every lock.
+ */
+static inline int shadow_index(unsigned long len, int offset)
+{
+	if (offset < 0 || (offset & 3) || (unsigned long) offset + 4 > len)
+		return -1;
+	return offset >> 2;
+}
+
+static uint32_t shadow_read(MERAM *meram, struct meram_shadow *sh,
+	u8 *base, unsigned long len, int offset)
+{
+	volatile uint32_t *reg = (uint32_t *) (base + offset);
+	int i = shadow_index(len, offset);
+	uint32_t val;
+
+	if (!meram->shadow || i < 0 || (sh->nocache & (1U << i))) {
+		val = *reg;
+		MERAM_TRACE_MMIO(MERAM_TRACE_MMIO_READ, reg, val);
+		return val;
+	}
+	if (sh->valid & (1U << i))
+		return sh->val[i];
+	val = *reg;
+	MERAM_TRACE_MMIO(MERAM_TRACE_MMIO_READ, reg, val);
+	sh->val[i] = val;
+	sh->valid |= 1U << i;
+	return val;
+}
+
+/* returns 1 if the write reached the hardware, 0 if it was elided */
+static int shadow_write(MERAM *meram, struct meram_shadow *sh,
+	u8 *base, unsigned long len, int offset, uint32_t val)
+{
+	volatile uint32_t *reg = (uint32_t *) (base + offset);
+	int i = shadow_index(len, offset);
+
+	if (!meram->shadow || i < 0) {
+		*reg = val;
+		MERAM_TRACE_MMIO(MERAM_TRACE_MMIO_WRITE, reg, val);
+		return 1;
+	}
+	if (!(sh->nocache & (1U << i))) {
+		if ((sh->valid & (1U << i)) && sh->val[i] == val) {
+			__atomic_add_fetch(&meram->writes_elided, 1,
+				__ATOMIC_RELAXED);
+			return 0;
+		}
+		sh->val[i] = val;
+		sh->valid |= 1U << i;
+	}
+	*reg = val;
+	MERAM_TRACE_MMIO(MERAM_TRACE_MMIO_WRITE, reg, val);
+	__atomic_add_fetch(&meram->writes_issued, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+static int shadow_write_batch(MERAM *meram, struct meram_shadow *sh,
+	u8 *base, unsigned long len, const struct meram_reg_op *ops, int n)
+{
+	uint32_t val;
+	int i, issued = 0;
+
+	if (!meram->shadow)
+		return meram_reg_write_batch(base, len, ops, n);
+	if (meram_reg_check_batch(len, ops, n) < 0)
+		return -1;
+	for (i = 0; i < n; i++) {
+		val = ops[i].val;
+		if (ops[i].mask)
+			val = (shadow_read(meram, sh, base, len, ops[i].offset) &
+			       ~ops[i].mask) | (val & ops[i].mask);
+		issued |= shadow_write(meram, sh, base, len, ops[i].offset,
+				       val);
+	}
+	if (issued)
+		__sync_synchronize();
+	return 0;
+}
+
+static int shadow_read_batch(MERAM *meram, struct meram_shadow *sh,
+	u8 *base, unsigned long len, struct meram_reg_op *ops, int n)
+{
+	int i;
+
+	if (!meram->shadow)
+		return meram_reg_read_batch(base, len, ops, n);
+	if (meram_reg_check_batch(len, ops, n) < 0)
+		return -1;
+	for (i = 0; i < n; i++) {
+		ops[i].val = shadow_read(meram, sh, base, len, ops[i].offset);
+		if (ops[i].mask)
+			ops[i].val &= ops[i].mask;
+	}
+	return 0;
+}
+
 int meram_read_icb(MERAM *meram, ICB *icb, int offset,
 		unsigned long *read_val)
 {
-	volatile unsigned long *reg;
 	if (!meram || !icb)
 		return -1;
-	reg = (unsigned long *) ((u8 *)meram->vaddr + icb->offset + offset);
-	*read_val = *reg;
+	*read_val = shadow_read(meram, &icb->shadow,
+		(u8 *)meram->vaddr + icb->offset, icb->len, offset);
 	return 0;
 }
 int meram_write_icb(MERAM *meram, ICB *icb, int offset, unsigned long val)
 {
-	volatile unsigned long *reg;
 	if (!meram || !icb)
 		return -1;
-	reg = (unsigned long *) ((u8 *)meram->vaddr + icb->offset + offset);
-	*reg = val;
+	shadow_write(meram, &icb->shadow, (u8 *)meram->vaddr + icb->offset,
+		icb->len, offset, val);
 	return 0;
 }
 int meram_read_reg(MERAM *meram, MERAM_REG *meram_reg, int offset,
 		unsigned long *read_val)
 {
-	volatile unsigned long *reg;
 	if (!meram || !meram_reg)
 		return -1;
-	reg = (unsigned long *) ((u8 *)meram->vaddr + meram_reg->offset +
+	*read_val = shadow_read(meram, &meram_reg->shadow,
+		(u8 *)meram->vaddr + meram_reg->offset, meram_reg->len,
 		offset);
-	*read_val = *reg;
 	return 0;
 }
 int meram_write_reg(MERAM *meram, MERAM_REG *meram_reg, int offset,
 		unsigned long val)
 {
-	volatile unsigned long *reg;
 	if (!meram || !meram_reg)
 		return -1;
-	reg = (unsigned long *) ((u8 *)meram->vaddr + meram_reg->offset +
-		offset);
-	*reg = val;
+	shadow_write(meram, &meram_reg->shadow,
+		(u8 *)meram->vaddr + meram_reg->offset, meram_reg->len,
+		offset, val);
 	return 0;
 }
 
-unsigned long
-meram_get_icb_address(MERAM *meram, ICB *icb, int ab) {
-	if (icb)
-		return (0xC0000000 | ((ab & 1) << 23) |
-				((icb->index & 0x1F) << 24));
-	return 0;
+int meram_write_icb_batch(MERAM *meram, ICB *icb,
+		const struct meram_reg_op *ops, int n)
+{
+	if (!meram || !icb)
+		return -1;
+	return shadow_write_batch(meram, &icb->shadow,
+		(u8 *)meram->vaddr + icb->offset, icb->len, ops, n);
 }
-
-#define TOKENS " \t"
-#define LINE_LEN 255
-int
-parse_config_file(char *infile,
-	struct reserved_address **add_head,
-	struct ipmmui_settings **ipmmui_head)
-{
-	int len = LINE_LEN;
-	struct reserved_address *add_current = NULL, *add_prev = NULL;
-	struct ipmmui_settings *ipmmui_current = NULL, *ipmmui_prev = NULL;
-	int i, num_fields;
-	char **fields;
-	FILE *cfg_file;
-	char linedata[LINE_LEN];
-	int line_cnt = 1;
-	char *id;
-
-	cfg_file = fopen (infile, "r");
-	if (!cfg_file)
+int meram_read_icb_batch(MERAM *meram, ICB *icb,
+		struct meram_reg_op *ops, int n)
+{
+	if (!meram || !icb)
+		return -1;
+	return shadow_read_batch(meram, &icb->shadow,
+		(u8 *)meram->vaddr + icb->offset, icb->len, ops, n);
+}
+int meram_write_reg_batch(MERAM *meram, MERAM_REG *meram_reg,
+		const struct meram_reg_op *ops, int n)
+{
+	if (!meram || !meram_reg)
+		return -1;
+	return shadow_write_batch(meram, &meram_reg->shadow,
+		(u8 *)meram->vaddr + meram_reg->offset, meram_reg->len,
+		ops, n);
+}
+int meram_read_reg_batch(MERAM *meram, MERAM_REG *meram_reg,
+		struct meram_reg_op *ops, int n)
+{
+	if (!meram || !meram_reg)
 		return -1;
+	return shadow_read_batch(meram, &meram_reg->shadow,
+		(u8 *)meram->vaddr + meram_reg->offset, meram_reg->len,
+		ops, n);
+}
 
-	while (fgets(linedata, len, cfg_file)) {
-		id = strtok(linedata, TOKENS);
-		if (id[0] == '#' || id[0] == '\n' || id[0] == 0) {
-			line_cnt ++;
-			continue;
-		}
-		if (!strcmp(id, "reserved")) {
-			num_fields = 2;
-		} else if (!strcmp(id, "ipmmui")) {
-			num_fields = 3;
-		} else
-			continue;
-
-		fields = calloc (num_fields, sizeof (char *));
-		for (i = 0; i < num_fields; i++) {
-			if (!(fields[i] = strtok(NULL, TOKENS))) {
-				fprintf(stderr, "Line %d: "
-					"Invalid data\n", line_cnt);
-				fclose(cfg_file);
-				return -1;
-			}
-		}
-		if (strtok(NULL, TOKENS)) {
-			fprintf(stderr, "Line %d: Too few tokens\n",
-				line_cnt);
-			fclose(cfg_file);
-			return -1;
-		}
-		if (!strcmp(id, "reserved")) {
-			if (!add_current)
-				add_current = *add_head = calloc (1,
-					sizeof (struct reserved_address));
-			else {
-				add_current = calloc (1,
-					sizeof (struct reserved_address));
-				add_prev->next = add_current;
-			}
-			add_current->start_block = atoi(fields[0]);
-			add_current->end_block = atoi(fields[1]);
-			add_current->next = NULL;
-			add_prev = add_current;
-		} else if (!strcmp(id, "ipmmui")) {
-			if (!ipmmui_current)
-				ipmmui_current = *ipmmui_head = calloc (1,
-					sizeof (struct ipmmui_settings));
-			else {
-				ipmmui_current = calloc (1,
-					sizeof (struct ipmmui_settings));
-				ipmmui_prev->next = ipmmui_current;
-			}
-			ipmmui_current->tag = strdup(fields[0]);
-			ipmmui_current->vaddr = strtoul(fields[1], NULL, 0);
-			ipmmui_current->size = atoi(fields[2]);
-			ipmmui_current->next = NULL;
-			ipmmui_prev = ipmmui_current;
-		}
-		line_cnt ++;
-		free(fields);
-	}
-	fclose(cfg_file);
+int meram_set_shadow(MERAM *meram, int enable)
+{
+	if (!meram)
+		return -1;
+	meram->shadow = !!enable;
 	return 0;
 }
 
-void
-delete_reserved_addr_list(struct reserved_address *head)
+void meram_get_shadow_stats(MERAM *meram, unsigned long *issued,
+		unsigned long *elided)
 {
-	struct reserved_address *next = head;
-	while (head) {
-		next = head->next;
-		free(head);
-		head = next;
-	}
+	if (!meram)
+		return;
+	if (issued)
+		*issued = __atomic_load_n(&meram->writes_issued,
+			__ATOMIC_RELAXED);
+	if (elided)
+		*elided = __atomic_load_n(&meram->writes_elided,
+			__ATOMIC_RELAXED);
 }
 
-void
-delete_ipmmui_settings(struct ipmmui_settings *head)
-{
-	struct ipmmui_settings *next = head;
-	while (head) {
-		next = head->next;
-		free(head->tag);
-		free(head);
-		head = next;
-	}
+unsigned long
+meram_get_icb_address(MERAM *meram, ICB *icb, int ab) {
+	if (icb)
+		return (0xC0000000 | ((ab & 1) << 23) |
+				((icb->index & 0x1F) << 24));
+	return 0;
 }
 
 int
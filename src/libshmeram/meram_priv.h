@@ -3,16 +3,77 @@
 #define UIOMUX_SH_MERAM 1
 #define UIOMUX_SH_IPMMUI 2
 
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+/*
+ * Backend used to reach the MERAM/IPMMUI hardware. The uiomux backend
+ * talks to the UIO devices, the simulator backend stands in for them
+ * with anonymous memory so that the library can run on any Linux host.
+ * The backend is selected at build time (--enable-simulator).
+ */
+struct meram_backend_ops {
+	const char *name;
+	void *(*open)(const char **names);
+	void (*close)(void *uio);
+	int (*get_mmio)(void *uio, int resource, unsigned long *paddr,
+			unsigned long *len, void **vaddr);
+	int (*get_mem)(void *uio, int resource, unsigned long *paddr,
+		       unsigned long *len, void **vaddr);
+	int (*lock)(void *uio, int resource);
+	int (*unlock)(void *uio, int resource);
+	int (*partial_lock)(void *uio, int resource, int offset, int count);
+	int (*partial_unlock)(void *uio, int resource, int offset, int count);
+};
+
+extern const struct meram_backend_ops meram_uiomux_backend;
+extern const struct meram_backend_ops meram_sim_backend;
+
+#ifdef MERAM_SIMULATOR
+#define meram_backend (&meram_sim_backend)
+#else
+#define meram_backend (&meram_uiomux_backend)
+#endif
+
+/*
+ * Shadow copy of a register block. Registers in @nocache are changed by
+ * the hardware or trigger an action when written, so they are never
+ * served from or elided by the shadow.
+ */
+struct meram_shadow {
+	uint32_t val[32];
+	uint32_t valid;
+	uint32_t nocache;
+};
+
+struct MERAM_REG {
+	int locked;
+	unsigned long offset;
+	unsigned long len;
+	struct meram_shadow shadow;
+	uint64_t trace_ts;
+};
+
 struct MERAM {
-	UIOMux *uiomux;
+	void *uiomux;
 	unsigned long paddr;
 	void *vaddr;
 	unsigned long len;
 	unsigned long mem_paddr;
 	void *mem_vaddr;
 	unsigned long mem_len;
-	struct reserved_address *reserved_mem;
-	struct ipmmui_settings *ipmmui_config;
+	struct meram_shared *shared;
+	uint32_t tag;
+	struct MERAM_REG reg;
+	int shadow;
+	unsigned long writes_issued;
+	unsigned long writes_elided;
+	/* arenas still open on the handle, see arena.c */
+	pthread_mutex_t arena_mutex;
+	struct MERAM_ARENA *arenas;
 };
 
 struct ICB {
@@ -22,54 +83,327 @@ struct ICB {
 	unsigned long len;
 	int mem_block;
 	int mem_size;
+	/* tag of the MERAM handle the memory is allocated under */
+	uint32_t mem_tag;
 	int index;
+	int configured;
+	struct meram_icb_config config;
+	/* ICBs of further planes using this ICB's memory, see icb_config.c */
+	struct ICB *plane_parent;
+	struct ICB *plane_next;
+	int plane_block;
+	/* degradation policy, see policy.c */
+	int policy;
+	int min_lines;
+	int max_lines;
+	int grow_holdoff;
+	meram_shrink_cb shrink_cb;
+	void *shrink_arg;
+	struct meram_shadow shadow;
+	uint64_t trace_ts;
 };
 
-struct MERAM_REG {
+/* size of the common register blocks */
+#define MERAM_REG_LEN	0x80
+#define IPMMUI_REG_LEN	0x24
+
+struct PMB {
+	unsigned long offset;
+	unsigned long lock_offset;
+	unsigned long len;
+	int index;
+	int locked;
+	/* IMPMBA/IMPMBD programmed by ipmmui_map */
+	int mapped;
+};
+struct IPMMUI_REG {
 	int locked;
 	unsigned long offset;
 	unsigned long len;
+	uint64_t trace_ts;
 };
 
+#define IPMMUI_PMB_COUNT	16
+
+/* IPMMUI virtual address space handed out by ipmmui_map */
+#define IPMMUI_VA_START		0x80000000UL
+#define IPMMUI_VA_END		0xC0000000UL
+
 struct IPMMUI {
 	MERAM *meram;
-	UIOMux *uiomux;
+	void *uiomux;
 	unsigned long paddr;
 	void *vaddr;
 	unsigned long len;
+	struct IPMMUI_REG reg;
+	struct PMB pmb[IPMMUI_PMB_COUNT];
 };
 
-struct PMB {
-	unsigned long offset;
-	unsigned long lock_offset;
-	int index;
+/*
+ * Tracing, see trace.c. The macros compile to nothing unless the library
+ * is configured with --enable-trace.
+ */
+enum meram_trace_event {
+	MERAM_TRACE_ICB_WAIT,		/* arg: ICB index, val: < 0 if failed */
+	MERAM_TRACE_ICB_HOLD,		/* arg: ICB index */
+	MERAM_TRACE_REG_WAIT,		/* arg: uiomux resource */
+	MERAM_TRACE_REG_HOLD,		/* arg: uiomux resource */
+	MERAM_TRACE_POOL_WAIT,		/* shared state lock */
+	MERAM_TRACE_ALLOC,		/* arg: blocks, val: first block or -1 */
+	MERAM_TRACE_FREE,		/* arg: blocks, val: first block */
+	MERAM_TRACE_MMIO_READ,		/* addr: register, val: value */
+	MERAM_TRACE_MMIO_WRITE,		/* addr: register, val: value */
 };
-struct IPMMUI_REG {
-	int locked;
-	unsigned long offset;
-	unsigned long len;
+
+#ifdef MERAM_TRACE
+uint64_t meram_trace_now(void);
+void meram_trace_record(int event, uint64_t start, uint64_t addr,
+	uint32_t val);
+void meram_trace_window(void *vaddr, unsigned long len, unsigned long paddr);
+
+#define MERAM_TRACE_NOW()	meram_trace_now()
+#define MERAM_TRACE_SPAN(event, start, arg, val)			\
+	meram_trace_record(event, start, arg, val)
+#define MERAM_TRACE_MMIO(event, reg, val)				\
+	meram_trace_record(event, 0, (uintptr_t) (reg), val)
+#define MERAM_TRACE_WINDOW(vaddr, len, paddr)				\
+	meram_trace_window(vaddr, len, paddr)
+#else
+#define MERAM_TRACE_NOW()	0
+#define MERAM_TRACE_SPAN(event, start, arg, val)	((void) (start))
+#define MERAM_TRACE_MMIO(event, reg, val)		do { } while (0)
+#define MERAM_TRACE_WINDOW(vaddr, len, paddr)		do { } while (0)
+#endif
+
+/*
+ * Apply a batch of register accesses to the register block at @base of
+ * @len bytes. All offsets are validated before anything is accessed and
+ * a barrier makes sure the writes have been issued on return.
+ */
+static inline int meram_reg_check_batch(unsigned long len,
+	const struct meram_reg_op *ops, int n)
+{
+	int i;
+
+	if (!ops || n < 0)
+		return -1;
+	for (i = 0; i < n; i++) {
+		if (ops[i].offset < 0 || (ops[i].offset & 3) ||
+		    (unsigned long) ops[i].offset + 4 > len)
+			return -1;
+	}
+	return 0;
+}
+
+static inline int meram_reg_write_batch(void *base, unsigned long len,
+	const struct meram_reg_op *ops, int n)
+{
+	volatile uint32_t *reg;
+	uint32_t val;
+	int i;
+
+	if (meram_reg_check_batch(len, ops, n) < 0)
+		return -1;
+	for (i = 0; i < n; i++) {
+		reg = (uint32_t *) ((uint8_t *) base + ops[i].offset);
+		val = ops[i].val;
+		if (ops[i].mask)
+			val = (*reg & ~ops[i].mask) | (val & ops[i].mask);
+		*reg = val;
+		MERAM_TRACE_MMIO(MERAM_TRACE_MMIO_WRITE, reg, val);
+	}
+	__sync_synchronize();
+	return 0;
+}
+
+static inline int meram_reg_read_batch(void *base, unsigned long len,
+	struct meram_reg_op *ops, int n)
+{
+	volatile uint32_t *reg;
+	int i;
+
+	if (meram_reg_check_batch(len, ops, n) < 0)
+		return -1;
+	for (i = 0; i < n; i++) {
+		reg = (uint32_t *) ((uint8_t *) base + ops[i].offset);
+		ops[i].val = *reg;
+		MERAM_TRACE_MMIO(MERAM_TRACE_MMIO_READ, reg, ops[i].val);
+		if (ops[i].mask)
+			ops[i].val &= ops[i].mask;
+	}
+	return 0;
+}
+
+#define MERAM_BLOCK_SHIFT	10
+#define MERAM_MAX_BLOCKS	1536
+#define MERAM_MAX_ORDER		10
+
+/* buddy allocator state for the MERAM memory, see buddy.c */
+struct meram_buddy {
+	int nblocks;
+	int16_t head[MERAM_MAX_ORDER + 1];
+	int16_t next[MERAM_MAX_BLOCKS];
+	int16_t prev[MERAM_MAX_BLOCKS];
+	int8_t order[MERAM_MAX_BLOCKS];
+};
+
+void meram_buddy_init(struct meram_buddy *b, int nblocks);
+int meram_buddy_alloc(struct meram_buddy *b, int count);
+int meram_buddy_claim(struct meram_buddy *b, int start, int count);
+void meram_buddy_free(struct meram_buddy *b, int start, int count);
+
+#ifndef MERAM_SHM_NAME
+#ifdef MERAM_SIMULATOR
+#define MERAM_SHM_NAME		"/libshmeram-sim"
+#else
+#define MERAM_SHM_NAME		"/libshmeram"
+#endif
+#endif
+
+/*
+ * Bionic has neither POSIX shared memory nor robust mutexes, so on
+ * Android the MERAM state is kept per process and meram.conf is parsed
+ * by every process.
+ */
+#ifdef __ANDROID__
+#define MERAM_PROCESS_LOCAL
+#endif
+
+/*
+ * The shared segment is only accessible to its owner and group. The
+ * group is that of the device opened by libuiomux, so that everyone who
+ * may use MERAM can share the state.
+ */
+#define MERAM_SHM_MODE		0660
+#if !defined(MERAM_SHM_GROUP_DEV) && !defined(MERAM_SIMULATOR)
+#define MERAM_SHM_GROUP_DEV	"/dev/uio0"
+#endif
+
+/* owner recorded for blocks reserved in the configuration file */
+#define MERAM_OWNER_RESERVED	((pid_t) -1)
+
+/*
+ * Degradation policy of an ICB, see policy.c. Sizes are in blocks,
+ * @shrink is the number of blocks other processes asked the owner to
+ * give back.
+ */
+struct meram_icb_policy {
+	int32_t active;
+	int32_t priority;
+	int32_t size;
+	int32_t min_size;
+	int32_t shrink;
+};
+
+/* allocation state shared between processes, see shared.c */
+struct meram_shared {
+	uint32_t magic;
+	uint32_t version;
+	pthread_mutex_t lock;
+	uint32_t icb_inuse[(MAX_ICB_INDEX + 1) >> 5];
+	uint32_t icb_seq[MAX_ICB_INDEX + 1];
+	uint32_t icb_waiters[MAX_ICB_INDEX + 1];
+	pid_t icb_owner[MAX_ICB_INDEX + 1];
+	uint32_t icb_any_seq;
+	uint32_t icb_any_waiters;
+	struct meram_icb_policy icb_policy[MAX_ICB_INDEX + 1];
+	pid_t pmb_owner[IPMMUI_PMB_COUNT];
+	uint32_t pmb_vaddr[IPMMUI_PMB_COUNT];
+	uint32_t pmb_size[IPMMUI_PMB_COUNT];
+	pid_t blk_owner[MERAM_MAX_BLOCKS];
+	uint32_t blk_tag[MERAM_MAX_BLOCKS];
+	/* meram.conf reservations the owner table matches, see shared.c */
+	uint32_t reserved_key;
+	uint32_t conf_stamp;
+	struct meram_buddy pool;
+	/* allocation counters, see meram_get_stats */
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long failures;
+	unsigned long alloc_ns_total;
+	unsigned long alloc_ns_max;
+	/* last scan for dead owners after a failed allocation */
+	uint64_t recover_ns;
+};
+
+struct meram_extent {
+	int start;
+	int count;
 };
 
+struct meram_shared *meram_shared_attach(int nblocks);
+void meram_shared_detach(struct meram_shared *sh);
+int meram_shared_alloc_blocks(struct meram_shared *sh, int count,
+	uint32_t tag);
+int meram_shared_claim_blocks(struct meram_shared *sh, int start, int count,
+	uint32_t tag);
+int meram_shared_alloc_lowest(struct meram_shared *sh, int count, int limit,
+	uint32_t tag);
+int meram_shared_free_blocks(struct meram_shared *sh, int start, int count,
+	uint32_t tag);
+void meram_shared_free_tag(struct meram_shared *sh, uint32_t tag);
+void meram_shared_get_stats(struct meram_shared *sh,
+	struct meram_stats *stats);
+int meram_shared_free_runs(struct meram_shared *sh, struct meram_extent *runs,
+	int max);
+void meram_shared_set_policy(struct meram_shared *sh, int index,
+	int priority, int size, int min_size);
+int meram_shared_take_shrink(struct meram_shared *sh, int index);
+int meram_shared_reclaim(struct meram_shared *sh, int blocks, int priority);
+int meram_shared_lock_icb(struct meram_shared *sh, int index,
+	const struct timespec *deadline, int sync);
+int meram_shared_lock_any_icb(struct meram_shared *sh, int lo, int hi,
+	const struct timespec *deadline, int sync);
+void meram_shared_unlock_icb(struct meram_shared *sh, int index);
+int meram_shared_claim_pmb(struct meram_shared *sh, int index);
+int meram_shared_alloc_pmb(struct meram_shared *sh);
+void meram_shared_release_pmb(struct meram_shared *sh, int index);
+unsigned long meram_shared_map_pmb(struct meram_shared *sh, int index,
+	unsigned long size, unsigned long start, unsigned long end);
+
+void meram_icb_unlink_planes(ICB *icb);
+int meram_icb_plane_size(ICB *icb, int lines);
+int meram_icb_resize(MERAM *meram, ICB *icb, int lines);
+
+/* arenas left open when the handle is closed, see arena.c */
+void meram_arena_close_all(MERAM *meram);
+
+/* background fill/copy worker, see async.c */
+void meram_async_drain(MERAM *meram);
+void meram_async_shutdown(void);
+
+/*
+ * meram.conf, compiled into arrays, see config.c. Reserved ranges are
+ * merged and sorted, ipmmui settings are sorted by tag. Tags are offsets
+ * into @strings, @hash is an open addressing table of entry indices.
+ */
 struct reserved_address {
-	int start_block;
-	int end_block;
-	struct reserved_address *next;
+	int32_t start_block;
+	int32_t end_block;
 };
 
 struct ipmmui_settings {
-	char *tag;
-	unsigned long vaddr;
-	int size;
-	struct ipmmui_settings *next;
+	uint32_t tag;
+	int32_t line;
+	uint64_t vaddr;
+	int32_t size;
+	uint32_t hash;
 };
 
-int
-parse_config_file(char *infile,
-	struct reserved_address **add_head,
-	struct ipmmui_settings **ipmmui_head);
-void
-delete_reserved_addr_list(struct reserved_address *head);
+struct meram_config {
+	int n_reserved;
+	const struct reserved_address *reserved;
+	int n_ipmmui;
+	const struct ipmmui_settings *ipmmui;
+	int hash_size;
+	const uint32_t *hash;
+	const char *strings;
+	void *image;
+};
 
-void
-delete_ipmmui_settings(struct ipmmui_settings *head);
+const struct meram_config *meram_config_get(void);
+int meram_config_find_ipmmui(const char *tag);
+int meram_config_reserved_overlap(int start, int count);
+int meram_config_private(void);
+uint32_t meram_config_stamp(void);
 #endif
@@ -0,0 +1,180 @@
+#include <meram/meram.h>
+#include <stdlib.h>
+#include <string.h>
+#include "meram_priv.h"
+
+/*
+ * Planning of the MERAM use of a set of concurrent streams. Every
+ * stream first gets its minimum number of lines; if that fits, lines
+ * are then doubled stream by stream in priority order for as long as
+ * everything still fits in the free runs of MERAM. Fitting is checked
+ * by placing the extents first fit, largest first, as the allocator
+ * would for a fragmented pool.
+ */
+
+#define PLAN_MAX_RUNS	(MERAM_MAX_BLOCKS / 2 + 1)
+#define PLAN_ICB_FIRST	32	/* leave the common ICBs to the drivers */
+
+struct plan_state {
+	struct meram_extent runs[PLAN_MAX_RUNS];
+	int n_runs;
+};
+
+static int plan_lines(const struct meram_icb_config *cfg, int lines)
+{
+	/* 4:2:0 chroma only has half the lines of the luma */
+	if (cfg->format == MERAM_PF_CBCR420)
+		return lines > 1 ? lines / 2 : 1;
+	return lines;
+}
+
+static int plan_layout(struct meram_plan_stream *st, int lines)
+{
+	struct meram_icb_config cfgs[MERAM_MAX_PLANES];
+	int i;
+
+	for (i = 0; i < st->n_planes; i++) {
+		cfgs[i] = st->planes[i];
+		cfgs[i].lines = plan_lines(&cfgs[i], lines);
+	}
+	return meram_calc_layout(cfgs, st->n_planes, &st->layout);
+}
+
+/*
+ * The line limits of a stream with the defaults filled in; the caller's
+ * values are left as they are, so the same streams can be planned again.
+ */
+static int plan_limits(const struct meram_plan_stream *st, int *min_lines,
+	int *max_lines)
+{
+	*min_lines = st->min_lines > 0 ? st->min_lines : 1;
+	*max_lines = st->max_lines;
+	if (*max_lines <= 0 || *max_lines > 256)
+		*max_lines = 256;
+	/* caching more lines than the image has is of no use */
+	if (*max_lines > st->planes[0].height)
+		*max_lines = st->planes[0].height;
+	return *min_lines > *max_lines ? -1 : 0;
+}
+
+static int plan_cmp_size(const void *a, const void *b)
+{
+	const struct meram_plan_stream *x = *(struct meram_plan_stream * const *) a;
+	const struct meram_plan_stream *y = *(struct meram_plan_stream * const *) b;
+
+	return y->layout.size - x->layout.size;
+}
+
+/* place all streams first fit, largest first; 0 if everything fits */
+static int plan_fit(const struct plan_state *free_runs,
+	struct meram_plan_stream **order, int n)
+{
+	struct plan_state ps = *free_runs;
+	int i, r;
+
+	qsort(order, n, sizeof(*order), plan_cmp_size);
+	for (i = 0; i < n; i++) {
+		for (r = 0; r < ps.n_runs; r++)
+			if (ps.runs[r].count >= order[i]->layout.size)
+				break;
+		if (r == ps.n_runs)
+			return -1;
+		order[i]->block = ps.runs[r].start;
+		ps.runs[r].start += order[i]->layout.size;
+		ps.runs[r].count -= order[i]->layout.size;
+	}
+	return 0;
+}
+
+static int plan_cmp_priority(const void *a, const void *b)
+{
+	const struct meram_plan_stream *x = *(struct meram_plan_stream * const *) a;
+	const struct meram_plan_stream *y = *(struct meram_plan_stream * const *) b;
+
+	return y->priority - x->priority;
+}
+
+int meram_plan(MERAM *meram, struct meram_plan_stream *streams, int n)
+{
+	struct meram_plan_stream **order, **prio;
+	struct plan_state *free_runs;
+	struct meram_stats *stats;
+	int i, j, icb, grown, min_lines, max_lines, ret = -1;
+
+	if (!meram || !streams || n <= 0)
+		return -1;
+	for (i = 0; i < n; i++) {
+		struct meram_plan_stream *st = &streams[i];
+
+		if (st->n_planes < 1 || st->n_planes > MERAM_MAX_PLANES)
+			return -1;
+		if (plan_limits(st, &min_lines, &max_lines) < 0)
+			return -1;
+	}
+
+	order = calloc(2 * n, sizeof(*order));
+	free_runs = malloc(sizeof(*free_runs));
+	stats = malloc(sizeof(*stats));
+	if (!order || !free_runs || !stats)
+		goto out;
+	prio = order + n;
+	free_runs->n_runs = meram_shared_free_runs(meram->shared,
+		free_runs->runs, PLAN_MAX_RUNS);
+	meram_shared_get_stats(meram->shared, stats);
+
+	/* ICBs that nobody holds right now, one per plane */
+	icb = PLAN_ICB_FIRST;
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < streams[i].n_planes; j++) {
+			while (icb <= MAX_ICB_INDEX && stats->icb_owner[icb])
+				icb++;
+			if (icb > MAX_ICB_INDEX)
+				goto out;
+			streams[i].icb[j] = icb++;
+		}
+		for (; j < MERAM_MAX_PLANES; j++)
+			streams[i].icb[j] = -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		plan_limits(&streams[i], &min_lines, &max_lines);
+		streams[i].lines = min_lines;
+		if (plan_layout(&streams[i], streams[i].lines) < 0)
+			goto out;
+		order[i] = prio[i] = &streams[i];
+	}
+	if (plan_fit(free_runs, order, n) < 0)
+		goto out;
+
+	/* grow the highest priority streams first, one doubling at a time */
+	qsort(prio, n, sizeof(*prio), plan_cmp_priority);
+	do {
+		grown = 0;
+		for (i = 0; i < n; i++) {
+			struct meram_plan_stream *st = prio[i];
+			int lines = st->lines * 2;
+
+			plan_limits(st, &min_lines, &max_lines);
+			if (lines > max_lines)
+				lines = max_lines;
+			if (lines == st->lines)
+				continue;
+			if (plan_layout(st, lines) == 0 &&
+			    plan_fit(free_runs, order, n) == 0) {
+				st->lines = lines;
+				grown = 1;
+				break;
+			}
+			/* does not fit, keep what the stream had */
+			plan_layout(st, st->lines);
+		}
+	} while (grown);
+
+	/* recompute the placement of the final assignment */
+	ret = plan_fit(free_runs, order, n);
+out:
+	free(order);
+	free(free_runs);
+	free(stats);
+	return ret;
+}
@@ -0,0 +1,87 @@
+#include <meram/meram.h>
+#include "meram_priv.h"
+
+/* frame boundaries to wait after shrinking before growing again */
+#define MERAM_POLICY_HOLDOFF	60
+
+/*
+ * Graceful degradation under MERAM pressure. An ICB with a policy
+ * publishes its priority and how many blocks it could give back by
+ * dropping to its minimum number of lines. A higher priority user that
+ * runs out of memory asks lower priority ICBs to shrink; their owners
+ * apply the request at the next frame boundary (meram_apply_icb_policy)
+ * and are told about the new line count through their callback. When
+ * there is room again ICBs grow back towards their maximum.
+ */
+
+static void meram_publish_policy(MERAM *meram, ICB *icb)
+{
+	meram_shared_set_policy(meram->shared, icb->index, icb->policy,
+		icb->mem_size, meram_icb_plane_size(icb, icb->min_lines));
+}
+
+int meram_set_icb_policy(MERAM *meram, ICB *icb, int priority,
+	int min_lines, int max_lines, meram_shrink_cb cb, void *arg)
+{
+	if (!meram || !icb || !icb->configured || icb->plane_parent)
+		return -1;
+	if (min_lines < 1 || max_lines > 256 || min_lines > max_lines)
+		return -1;
+
+	icb->policy = priority;
+	icb->min_lines = min_lines;
+	icb->max_lines = max_lines;
+	icb->shrink_cb = cb;
+	icb->shrink_arg = arg;
+	meram_publish_policy(meram, icb);
+	return 0;
+}
+
+int meram_apply_icb_policy(MERAM *meram, ICB *icb)
+{
+	int request, lines, target, size;
+
+	if (!meram || !icb || !icb->min_lines)
+		return -1;
+
+	lines = icb->config.lines;
+	request = meram_shared_take_shrink(meram->shared, icb->index);
+	if (request > 0) {
+		/* the most lines that give back what was asked for */
+		target = lines;
+		size = icb->mem_size;
+		while (target > icb->min_lines &&
+		       size > icb->mem_size - request) {
+			target--;
+			size = meram_icb_plane_size(icb, target);
+		}
+	} else if (icb->grow_holdoff > 0) {
+		/* give whoever asked for the memory a chance to take it */
+		icb->grow_holdoff--;
+		target = lines;
+	} else {
+		/* grow back one doubling at a time while there is room */
+		target = lines * 2;
+		if (target > icb->max_lines)
+			target = icb->max_lines;
+	}
+	if (target == lines || meram_icb_resize(meram, icb, target) < 0) {
+		if (request > 0)
+			meram_publish_policy(meram, icb);
+		return 0;
+	}
+
+	if (target < lines)
+		icb->grow_holdoff = MERAM_POLICY_HOLDOFF;
+	meram_publish_policy(meram, icb);
+	if (icb->shrink_cb)
+		icb->shrink_cb(meram, icb, target, icb->shrink_arg);
+	return target;
+}
+
+int meram_reclaim_memory(MERAM *meram, int blocks, int priority)
+{
+	if (!meram || blocks <= 0)
+		return -1;
+	return meram_shared_reclaim(meram->shared, blocks, priority);
+}
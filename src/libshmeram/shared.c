@@ -0,0 +1,941 @@
+#include <meram/meram.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "meram_priv.h"
+
+/*
+ * MERAM allocation state shared by all processes using the library.
+ *
+ * ICB ownership and the MERAM block allocator live in a POSIX shared
+ * memory segment. The block allocator is protected by a robust, process
+ * shared mutex, ICBs are claimed with atomic operations. Every ICB
+ * and every allocated block records the pid of its owner, so that the
+ * state left behind by a process that died can be given back. The
+ * blocks reserved in meram.conf are owned by MERAM_OWNER_RESERVED and
+ * are checked against the file when a process attaches and finds that
+ * it changed since they were last brought in line with it. If the
+ * shared segment cannot be used, or with MERAM_PROCESS_LOCAL, the same
+ * state is kept process local.
+ */
+
+#define MERAM_SHM_MAGIC		0x4d455241	/* "MERA" */
+#define MERAM_SHM_VERSION	10
+
+/* how often a blocked ICB waiter checks whether the owner is still alive */
+#define MERAM_OWNER_POLL_MS	100
+
+/* how often a failed allocation looks for blocks of dead processes */
+#define MERAM_RECOVER_MS	100
+
+static int meram_pid_alive(pid_t pid)
+{
+	if (pid <= 0)
+		return 1;
+	return !(kill(pid, 0) < 0 && errno == ESRCH);
+}
+
+static int futex_wait(uint32_t *addr, uint32_t val,
+	const struct timespec *deadline)
+{
+	/* FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC timeout */
+	return syscall(SYS_futex, addr, FUTEX_WAIT_BITSET, val, deadline,
+		       NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+static void futex_wake(uint32_t *addr, int count)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+static void timespec_add_ms(struct timespec *ts, long ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static int timespec_before(const struct timespec *a,
+	const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec ||
+		(a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static int icb_release_dead(struct meram_shared *sh, int index);
+
+/* rebuild the buddy lists from the block owner table */
+static void shared_rebuild_pool(struct meram_shared *sh)
+{
+	int nblocks = sh->pool.nblocks;
+	int blk = 0;
+
+	meram_buddy_init(&sh->pool, nblocks);
+	while (blk < nblocks) {
+		int end = blk;
+
+		while (end < nblocks && sh->blk_owner[end])
+			end++;
+		if (end > blk)
+			meram_buddy_claim(&sh->pool, blk, end - blk);
+		blk = end + 1;
+	}
+}
+
+/*
+ * Give back everything owned by processes that no longer exist. The
+ * buddy lists are rebuilt if any blocks were recovered or if @rebuild
+ * is set, i.e. when a process died while modifying them.
+ */
+static int shared_recover(struct meram_shared *sh, int rebuild)
+{
+	pid_t checked = 0;
+	int alive = 1, recovered = 0;
+	int i;
+
+	for (i = 0; i <= MAX_ICB_INDEX; i++)
+		recovered += icb_release_dead(sh, i);
+
+	for (i = 0; i < sh->pool.nblocks; i++) {
+		pid_t pid = sh->blk_owner[i];
+
+		if (pid == 0 || pid == MERAM_OWNER_RESERVED)
+			continue;
+		if (pid != checked) {
+			checked = pid;
+			alive = meram_pid_alive(pid);
+		}
+		if (!alive) {
+			sh->blk_owner[i] = 0;
+			recovered++;
+			rebuild = 1;
+		}
+	}
+	if (rebuild)
+		shared_rebuild_pool(sh);
+	return recovered;
+}
+
+static void shared_lock(struct meram_shared *sh)
+{
+	uint64_t start = MERAM_TRACE_NOW();
+
+#ifdef MERAM_PROCESS_LOCAL
+	pthread_mutex_lock(&sh->lock);
+#else
+	if (pthread_mutex_lock(&sh->lock) == EOWNERDEAD) {
+		/* the previous holder died, possibly half way through */
+		shared_recover(sh, 1);
+		pthread_mutex_consistent(&sh->lock);
+	}
+#endif
+	MERAM_TRACE_SPAN(MERAM_TRACE_POOL_WAIT, start, 0, 0);
+}
+
+static void shared_unlock(struct meram_shared *sh)
+{
+	pthread_mutex_unlock(&sh->lock);
+}
+
+/* FNV-1a over the merged reserved ranges of meram.conf */
+static uint32_t shared_reserved_key(const struct meram_config *cfg)
+{
+	const uint8_t *p = (const uint8_t *) cfg->reserved;
+	size_t i, len = cfg->n_reserved * sizeof(*cfg->reserved);
+	uint32_t h = 2166136261U ^ cfg->n_reserved;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ p[i]) * 16777619U;
+	return h;
+}
+
+/*
+ * Make the reserved blocks match meram.conf, which may have been edited
+ * since the segment was set up. The file is only read when its @stamp
+ * differs from the one last applied. Blocks no longer listed are given
+ * back and free blocks of new ranges are taken. Blocks of a new range
+ * that are still in use are left to their owner; the configuration is
+ * then not marked as applied, so a later attach retries. Called with
+ * the pool locked, or before the segment is published.
+ */
+static void shared_sync_reserved(struct meram_shared *sh, uint32_t stamp,
+	int force)
+{
+	const struct meram_config *cfg;
+	uint32_t key;
+	int blk, reserved, changed = force, missing = 0;
+
+	if (!force && stamp == sh->conf_stamp)
+		return;
+	cfg = meram_config_get();
+	key = shared_reserved_key(cfg);
+	if (!force && key == sh->reserved_key) {
+		sh->conf_stamp = stamp;
+		return;
+	}
+	for (blk = 0; blk < sh->pool.nblocks; blk++) {
+		reserved = meram_config_reserved_overlap(blk, 1) >= 0;
+		if (sh->blk_owner[blk] == MERAM_OWNER_RESERVED) {
+			if (reserved)
+				continue;
+			sh->blk_owner[blk] = 0;
+			changed = 1;
+		} else if (reserved) {
+			if (sh->blk_owner[blk]) {
+				missing = 1;
+				continue;
+			}
+			sh->blk_owner[blk] = MERAM_OWNER_RESERVED;
+			sh->blk_tag[blk] = 0;
+			changed = 1;
+		}
+	}
+	if (changed)
+		shared_rebuild_pool(sh);
+	if (!missing) {
+		sh->reserved_key = key;
+		sh->conf_stamp = stamp;
+	}
+}
+
+static void shared_init(struct meram_shared *sh, int nblocks)
+{
+	pthread_mutexattr_t mattr;
+
+	memset(sh, 0, sizeof(*sh));
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+#ifndef MERAM_PROCESS_LOCAL
+	pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+#endif
+	pthread_mutex_init(&sh->lock, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+
+	if (nblocks > MERAM_MAX_BLOCKS)
+		nblocks = MERAM_MAX_BLOCKS;
+	meram_buddy_init(&sh->pool, nblocks);
+	shared_sync_reserved(sh, meram_config_stamp(), 1);
+
+	sh->version = MERAM_SHM_VERSION;
+	__sync_synchronize();
+	sh->magic = MERAM_SHM_MAGIC;
+}
+
+static struct meram_shared *shared_attach_private(int nblocks)
+{
+	struct meram_shared *sh;
+
+	sh = mmap(NULL, sizeof(*sh), PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (sh == MAP_FAILED)
+		return NULL;
+	shared_init(sh, nblocks);
+	return sh;
+}
+
+#ifdef MERAM_PROCESS_LOCAL
+
+struct meram_shared *meram_shared_attach(int nblocks)
+{
+	return shared_attach_private(nblocks);
+}
+
+#else
+
+/* give a new segment the group of the MERAM device, see MERAM_SHM_MODE */
+static void shared_set_access(int fd)
+{
+#ifdef MERAM_SHM_GROUP_DEV
+	struct stat st;
+
+	/* only possible for members of that group */
+	if (stat(MERAM_SHM_GROUP_DEV, &st) == 0 && fchown(fd, -1, st.st_gid) < 0)
+		fprintf(stderr, "libshmeram: cannot give the shared state the "
+			"group of %s\n", MERAM_SHM_GROUP_DEV);
+#endif
+	/* the mode given to shm_open is subject to the umask */
+	fchmod(fd, MERAM_SHM_MODE);
+}
+
+struct meram_shared *meram_shared_attach(int nblocks)
+{
+	struct meram_shared *sh = NULL;
+	char name[64];
+	struct stat st;
+	uint32_t stamp;
+	int fd;
+
+	/* reservations from another meram.conf must stay in this process */
+	if (meram_config_private())
+		return shared_attach_private(nblocks);
+
+	/* the layout version is part of the name so layouts never mix */
+	snprintf(name, sizeof(name), "%s.%d", MERAM_SHM_NAME,
+		 MERAM_SHM_VERSION);
+	fd = shm_open(name, O_RDWR | O_CREAT, MERAM_SHM_MODE);
+	if (fd < 0)
+		return shared_attach_private(nblocks);
+
+	/* the first process to get here sets the segment up */
+	if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0)
+		goto out;
+	if (st.st_size == 0) {
+		shared_set_access(fd);
+		if (ftruncate(fd, sizeof(*sh)) < 0)
+			goto out;
+	}
+	if (st.st_size != 0 && st.st_size != sizeof(*sh)) {
+		fprintf(stderr, "libshmeram: %s has an unexpected size, "
+			"MERAM state will not be shared\n", name);
+		goto out;
+	}
+	sh = mmap(NULL, sizeof(*sh), PROT_READ | PROT_WRITE, MAP_SHARED,
+		  fd, 0);
+	if (sh == MAP_FAILED) {
+		sh = NULL;
+		goto out;
+	}
+	if (sh->magic != MERAM_SHM_MAGIC) {
+		/* new segment, or its creator died while setting it up */
+		shared_init(sh, nblocks);
+	} else if (sh->version != MERAM_SHM_VERSION) {
+		fprintf(stderr, "libshmeram: %s version mismatch, "
+			"MERAM state will not be shared\n", name);
+		munmap(sh, sizeof(*sh));
+		sh = NULL;
+	} else {
+		stamp = meram_config_stamp();
+		shared_lock(sh);
+		shared_recover(sh, 0);
+		shared_sync_reserved(sh, stamp, 0);
+		shared_unlock(sh);
+	}
+out:
+	flock(fd, LOCK_UN);
+	close(fd);
+	if (!sh)
+		sh = shared_attach_private(nblocks);
+	return sh;
+}
+
+#endif
+
+void meram_shared_detach(struct meram_shared *sh)
+{
+	if (sh)
+		munmap(sh, sizeof(*sh));
+}
+
+static void shared_set_owner(struct meram_shared *sh, int start, int count,
+	pid_t pid, uint32_t tag)
+{
+	int i;
+
+	for (i = start; i < start + count; i++) {
+		sh->blk_owner[i] = pid;
+		sh->blk_tag[i] = tag;
+	}
+}
+
+/*
+ * Take @count blocks at the lowest free address below @limit (first fit
+ * over the owner table). Unlike the buddy allocator this needs no
+ * alignment, so it also finds room for sizes that are not a power of
+ * two in a fragmented pool.
+ */
+static int shared_first_fit(struct meram_shared *sh, int count, int limit)
+{
+	int blk, end;
+
+	if (limit > sh->pool.nblocks)
+		limit = sh->pool.nblocks;
+	for (blk = 0; blk < limit; blk = end + 1) {
+		end = blk;
+		while (end < sh->pool.nblocks && !sh->blk_owner[end] &&
+		       end - blk < count)
+			end++;
+		if (end - blk == count)
+			return meram_buddy_claim(&sh->pool, blk, count) < 0 ?
+				-1 : blk;
+	}
+	return -1;
+}
+
+/* allocate @count blocks as low as possible, used to pack allocations */
+int meram_shared_alloc_lowest(struct meram_shared *sh, int count, int limit,
+	uint32_t tag)
+{
+	int blk;
+
+	if (count <= 0)
+		return -1;
+	shared_lock(sh);
+	blk = shared_first_fit(sh, count, limit);
+	if (blk >= 0)
+		shared_set_owner(sh, blk, count, getpid(), tag);
+	shared_unlock(sh);
+	return blk;
+}
+
+static uint64_t shared_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Look for blocks of dead processes after an allocation failed. Callers
+ * such as the degradation policy retry every frame while MERAM is full,
+ * and a scan signals every owner, so this is done at most once per
+ * MERAM_RECOVER_MS across all processes. Called with the pool locked.
+ */
+static int shared_recover_failed(struct meram_shared *sh)
+{
+	uint64_t now = shared_now_ns();
+
+	if (sh->recover_ns &&
+	    now - sh->recover_ns < MERAM_RECOVER_MS * 1000000ULL)
+		return 0;
+	sh->recover_ns = now;
+	return shared_recover(sh, 0);
+}
+
+int meram_shared_alloc_blocks(struct meram_shared *sh, int count,
+	uint32_t tag)
+{
+	uint64_t start = shared_now_ns(), ns;
+	uint64_t trace_start = MERAM_TRACE_NOW();
+	int blk;
+
+	shared_lock(sh);
+	blk = meram_buddy_alloc(&sh->pool, count);
+	if (blk < 0 && shared_recover_failed(sh))
+		blk = meram_buddy_alloc(&sh->pool, count);
+	if (blk < 0 && count > 0)
+		blk = shared_first_fit(sh, count, sh->pool.nblocks);
+	if (blk >= 0) {
+		shared_set_owner(sh, blk, count, getpid(), tag);
+		sh->allocs++;
+	} else {
+		sh->failures++;
+	}
+	/* includes the time spent waiting for the pool lock */
+	ns = shared_now_ns() - start;
+	sh->alloc_ns_total += ns;
+	if (ns > sh->alloc_ns_max)
+		sh->alloc_ns_max = ns;
+	shared_unlock(sh);
+	MERAM_TRACE_SPAN(MERAM_TRACE_ALLOC, trace_start, count, blk);
+	return blk;
+}
+
+
+int meram_shared_claim_blocks(struct meram_shared *sh, int start, int count,
+	uint32_t tag)
+{
+	uint64_t trace_start = MERAM_TRACE_NOW();
+	int ret;
+
+	shared_lock(sh);
+	ret = meram_buddy_claim(&sh->pool, start, count);
+	if (ret < 0 && shared_recover_failed(sh))
+		ret = meram_buddy_claim(&sh->pool, start, count);
+	if (ret == 0)
+		shared_set_owner(sh, start, count, getpid(), tag);
+	shared_unlock(sh);
+	MERAM_TRACE_SPAN(MERAM_TRACE_ALLOC, trace_start, count,
+			 ret ? -1 : start);
+	return ret;
+}
+
+/*
+ * Returns -1 if some of the blocks were not owned by this process under
+ * @tag, those are left alone.
+ */
+int meram_shared_free_blocks(struct meram_shared *sh, int start, int count,
+	uint32_t tag)
+{
+	uint64_t trace_start = MERAM_TRACE_NOW();
+	pid_t pid = getpid();
+	int blk, end, ret = 0;
+
+	if (start < 0 || count <= 0 || start + count > sh->pool.nblocks)
+		return -1;
+
+	/*
+	 * only give back blocks that this handle actually owns, a stale
+	 * free must not release blocks reallocated by another handle
+	 */
+	shared_lock(sh);
+	blk = start;
+	while (blk < start + count) {
+		end = blk;
+		while (end < start + count && sh->blk_owner[end] == pid &&
+		       sh->blk_tag[end] == tag)
+			end++;
+		if (end > blk) {
+			shared_set_owner(sh, blk, end - blk, 0, 0);
+			meram_buddy_free(&sh->pool, blk, end - blk);
+			sh->frees++;
+		}
+		if (end < start + count)
+			ret = -1;
+		blk = end + 1;
+	}
+	shared_unlock(sh);
+	MERAM_TRACE_SPAN(MERAM_TRACE_FREE, trace_start, count, start);
+	return ret;
+}
+
+/* give back all blocks of this process allocated with @tag */
+void meram_shared_free_tag(struct meram_shared *sh, uint32_t tag)
+{
+	pid_t pid = getpid();
+	int blk, end;
+
+	shared_lock(sh);
+	blk = 0;
+	while (blk < sh->pool.nblocks) {
+		end = blk;
+		while (end < sh->pool.nblocks && sh->blk_owner[end] == pid &&
+		       sh->blk_tag[end] == tag)
+			end++;
+		if (end > blk) {
+			shared_set_owner(sh, blk, end - blk, 0, 0);
+			meram_buddy_free(&sh->pool, blk, end - blk);
+			sh->frees++;
+		}
+		blk = end + 1;
+	}
+	shared_unlock(sh);
+}
+
+void meram_shared_get_stats(struct meram_shared *sh,
+	struct meram_stats *stats)
+{
+	int blk, end, o;
+
+	memset(stats, 0, sizeof(*stats));
+	shared_lock(sh);
+	stats->total_blocks = sh->pool.nblocks;
+	for (blk = 0; blk < sh->pool.nblocks; blk = end) {
+		pid_t owner = sh->blk_owner[blk];
+
+		end = blk + 1;
+		while (end < sh->pool.nblocks && sh->blk_owner[end] == owner)
+			end++;
+		if (owner == 0) {
+			stats->free_blocks += end - blk;
+			stats->free_extents++;
+			if (end - blk > stats->largest_free)
+				stats->largest_free = end - blk;
+		} else if (owner == MERAM_OWNER_RESERVED) {
+			stats->reserved_blocks += end - blk;
+			if (stats->n_reserved < MERAM_STATS_MAX_RESERVED) {
+				stats->reserved[stats->n_reserved].start_block =
+					blk;
+				stats->reserved[stats->n_reserved].end_block =
+					end - 1;
+				stats->n_reserved++;
+			}
+		}
+	}
+	/* allocations fall back to first fit, so any free run can be used */
+	stats->max_alloc = stats->largest_free;
+	stats->allocs = sh->allocs;
+	stats->frees = sh->frees;
+	stats->failures = sh->failures;
+	stats->alloc_ns_total = sh->alloc_ns_total;
+	stats->alloc_ns_max = sh->alloc_ns_max;
+	shared_unlock(sh);
+
+	for (o = 0; o <= MAX_ICB_INDEX; o++)
+		stats->icb_owner[o] = __atomic_load_n(&sh->icb_owner[o],
+			__ATOMIC_RELAXED);
+}
+
+/* list the runs of free blocks in address order */
+int meram_shared_free_runs(struct meram_shared *sh, struct meram_extent *runs,
+	int max)
+{
+	int blk, end, n = 0;
+
+	shared_lock(sh);
+	for (blk = 0; blk < sh->pool.nblocks && n < max; blk = end + 1) {
+		end = blk;
+		while (end < sh->pool.nblocks && !sh->blk_owner[end])
+			end++;
+		if (end > blk) {
+			runs[n].start = blk;
+			runs[n].count = end - blk;
+			n++;
+		}
+	}
+	shared_unlock(sh);
+	return n;
+}
+
+void meram_shared_set_policy(struct meram_shared *sh, int index,
+	int priority, int size, int min_size)
+{
+	struct meram_icb_policy *pol = &sh->icb_policy[index];
+
+	shared_lock(sh);
+	pol->priority = priority;
+	pol->size = size;
+	pol->min_size = min_size;
+	if (pol->shrink > size - min_size)
+		pol->shrink = size - min_size;
+	if (pol->shrink < 0 || !pol->active)
+		pol->shrink = 0;
+	pol->active = 1;
+	shared_unlock(sh);
+}
+
+int meram_shared_take_shrink(struct meram_shared *sh, int index)
+{
+	struct meram_icb_policy *pol = &sh->icb_policy[index];
+	int blocks;
+
+	/* cheap check first, this is called once per frame */
+	if (!__atomic_load_n(&pol->shrink, __ATOMIC_RELAXED))
+		return 0;
+	shared_lock(sh);
+	blocks = pol->shrink;
+	pol->shrink = 0;
+	shared_unlock(sh);
+	return blocks;
+}
+
+/*
+ * Ask the owners of ICBs of lower priority than @priority to give back
+ * @blocks blocks in total, lowest priority first. Nothing is asked for
+ * unless enough can be given back. Returns the blocks asked for.
+ */
+int meram_shared_reclaim(struct meram_shared *sh, int blocks, int priority)
+{
+	struct meram_icb_policy *pol, *victim;
+	int i, avail = 0, need = blocks;
+
+	shared_lock(sh);
+	for (i = 0; i <= MAX_ICB_INDEX; i++) {
+		pol = &sh->icb_policy[i];
+		if (pol->active && pol->priority < priority)
+			avail += pol->size - pol->min_size - pol->shrink;
+	}
+	if (avail < blocks) {
+		shared_unlock(sh);
+		return -1;
+	}
+	while (need > 0) {
+		victim = NULL;
+		for (i = 0; i <= MAX_ICB_INDEX; i++) {
+			pol = &sh->icb_policy[i];
+			if (!pol->active || pol->priority >= priority ||
+			    pol->size - pol->min_size - pol->shrink <= 0)
+				continue;
+			if (!victim || pol->priority < victim->priority)
+				victim = pol;
+		}
+		avail = victim->size - victim->min_size - victim->shrink;
+		if (avail > need)
+			avail = need;
+		victim->shrink += avail;
+		need -= avail;
+	}
+	shared_unlock(sh);
+	return blocks;
+}
+
+/*
+ * ICBs are claimed with an atomic fetch_or on the in-use bitmap and do
+ * not take the shared mutex. Each ICB has its own futex word, bumped on
+ * every release, so that an unlock only wakes the waiters for that ICB.
+ */
+static void icb_release(struct meram_shared *sh, int index)
+{
+	uint32_t mask = 1U << (index & 31);
+
+	__atomic_store_n(&sh->icb_policy[index].active, 0, __ATOMIC_RELAXED);
+	__atomic_fetch_and(&sh->icb_inuse[index >> 5], ~mask,
+			   __ATOMIC_SEQ_CST);
+	__atomic_fetch_add(&sh->icb_seq[index], 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sh->icb_waiters[index], __ATOMIC_SEQ_CST))
+		futex_wake(&sh->icb_seq[index], INT_MAX);
+
+	/* waiters for any ICB in a range share one futex word */
+	__atomic_fetch_add(&sh->icb_any_seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sh->icb_any_waiters, __ATOMIC_SEQ_CST))
+		futex_wake(&sh->icb_any_seq, INT_MAX);
+}
+
+/* release the ICB if its owner died, returns 1 if it did */
+static int icb_release_dead(struct meram_shared *sh, int index)
+{
+	pid_t pid = __atomic_load_n(&sh->icb_owner[index], __ATOMIC_ACQUIRE);
+
+	if (!pid || meram_pid_alive(pid))
+		return 0;
+	/* only one process gets to release it */
+	if (!__atomic_compare_exchange_n(&sh->icb_owner[index], &pid, 0, 0,
+					 __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		return 0;
+	icb_release(sh, index);
+	return 1;
+}
+
+int meram_shared_lock_icb(struct meram_shared *sh, int index,
+	const struct timespec *deadline, int sync)
+{
+	uint32_t *word = &sh->icb_inuse[index >> 5];
+	uint32_t mask = 1U << (index & 31);
+	struct timespec now, ts;
+	uint32_t seq;
+
+	for (;;) {
+		if (!(__atomic_fetch_or(word, mask, __ATOMIC_SEQ_CST) & mask))
+			break;
+		if (!sync)
+			return -1;
+
+		seq = __atomic_load_n(&sh->icb_seq[index], __ATOMIC_SEQ_CST);
+		__atomic_fetch_add(&sh->icb_waiters[index], 1,
+				   __ATOMIC_SEQ_CST);
+		if ((__atomic_load_n(word, __ATOMIC_SEQ_CST) & mask) &&
+		    !icb_release_dead(sh, index)) {
+			/* wake up now and then to check the owner is alive */
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			timespec_add_ms(&ts, MERAM_OWNER_POLL_MS);
+			if (deadline && timespec_before(deadline, &ts))
+				ts = *deadline;
+			futex_wait(&sh->icb_seq[index], seq, &ts);
+		}
+		__atomic_fetch_sub(&sh->icb_waiters[index], 1,
+				   __ATOMIC_SEQ_CST);
+
+		if (deadline) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (!timespec_before(&now, deadline)) {
+				/* one last attempt before giving up */
+				if (__atomic_fetch_or(word, mask,
+						      __ATOMIC_SEQ_CST) & mask)
+					return -ETIMEDOUT;
+				break;
+			}
+		}
+	}
+	__atomic_store_n(&sh->icb_owner[index], getpid(), __ATOMIC_RELEASE);
+	return 0;
+}
+
+void meram_shared_unlock_icb(struct meram_shared *sh, int index)
+{
+	__atomic_store_n(&sh->icb_owner[index], 0, __ATOMIC_RELEASE);
+	icb_release(sh, index);
+}
+
+/* mask of the bits of in-use word @slot that fall within [lo, hi] */
+static uint32_t icb_range_mask(int slot, int lo, int hi)
+{
+	int first = slot << 5, last = first + 31;
+	uint32_t mask = 0xffffffffU;
+
+	if (lo > first)
+		mask &= 0xffffffffU << (lo - first);
+	if (hi < last)
+		mask &= 0xffffffffU >> (last - hi);
+	return mask;
+}
+
+/* claim the lowest free ICB in [lo, hi], -1 if they are all in use */
+static int icb_claim_any(struct meram_shared *sh, int lo, int hi)
+{
+	int slot;
+
+	for (slot = lo >> 5; slot <= hi >> 5; slot++) {
+		uint32_t *word = &sh->icb_inuse[slot];
+		uint32_t range = icb_range_mask(slot, lo, hi);
+		uint32_t free_bits;
+
+		free_bits = ~__atomic_load_n(word, __ATOMIC_SEQ_CST) & range;
+		while (free_bits) {
+			uint32_t bit = free_bits & -free_bits;
+			uint32_t old;
+
+			old = __atomic_fetch_or(word, bit, __ATOMIC_SEQ_CST);
+			if (!(old & bit))
+				return (slot << 5) + __builtin_ctz(bit);
+			/* lost the race, retry with what is still free */
+			free_bits = ~(old | bit) & range;
+		}
+	}
+	return -1;
+}
+
+int meram_shared_lock_any_icb(struct meram_shared *sh, int lo, int hi,
+	const struct timespec *deadline, int sync)
+{
+	struct timespec now, ts;
+	uint32_t seq;
+	int index, i;
+
+	for (;;) {
+		index = icb_claim_any(sh, lo, hi);
+		if (index >= 0)
+			break;
+		if (!sync)
+			return -1;
+
+		seq = __atomic_load_n(&sh->icb_any_seq, __ATOMIC_SEQ_CST);
+		__atomic_fetch_add(&sh->icb_any_waiters, 1, __ATOMIC_SEQ_CST);
+		index = icb_claim_any(sh, lo, hi);
+		if (index < 0) {
+			for (i = lo; i <= hi; i++)
+				icb_release_dead(sh, i);
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			ts = now;
+			timespec_add_ms(&ts, MERAM_OWNER_POLL_MS);
+			if (deadline && timespec_before(deadline, &ts))
+				ts = *deadline;
+			futex_wait(&sh->icb_any_seq, seq, &ts);
+		}
+		__atomic_fetch_sub(&sh->icb_any_waiters, 1, __ATOMIC_SEQ_CST);
+		if (index >= 0)
+			break;
+
+		if (deadline) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (!timespec_before(&now, deadline)) {
+				index = icb_claim_any(sh, lo, hi);
+				if (index < 0)
+					return -ETIMEDOUT;
+				break;
+			}
+		}
+	}
+	__atomic_store_n(&sh->icb_owner[index], getpid(), __ATOMIC_RELEASE);
+	return index;
+}
+
+/*
+ * IPMMUI PMB entries. An entry is claimed by swapping its owner from 0
+ * (or from a process that died) to our pid, so it never has more than
+ * one user. The virtual address window an entry maps is recorded next
+ * to the owner and only changed under the shared lock.
+ */
+int meram_shared_claim_pmb(struct meram_shared *sh, int index)
+{
+	pid_t pid = __atomic_load_n(&sh->pmb_owner[index], __ATOMIC_ACQUIRE);
+
+	if (pid && meram_pid_alive(pid))
+		return -1;
+	if (!__atomic_compare_exchange_n(&sh->pmb_owner[index], &pid,
+					 getpid(), 0, __ATOMIC_SEQ_CST,
+					 __ATOMIC_SEQ_CST))
+		return -1;
+	/* forget the window a dead owner left behind */
+	shared_lock(sh);
+	sh->pmb_vaddr[index] = 0;
+	sh->pmb_size[index] = 0;
+	shared_unlock(sh);
+	return 0;
+}
+
+/*
+ * Users of ipmmui_lock_pmb pick fixed indices, usually from 0 up, so
+ * dynamic entries are taken from the top down to leave those free.
+ */
+int meram_shared_alloc_pmb(struct meram_shared *sh)
+{
+	int i;
+
+	for (i = IPMMUI_PMB_COUNT - 1; i >= 0; i--)
+		if (meram_shared_claim_pmb(sh, i) == 0)
+			return i;
+	return -1;
+}
+
+void meram_shared_release_pmb(struct meram_shared *sh, int index)
+{
+	pid_t pid = getpid();
+
+	shared_lock(sh);
+	if (sh->pmb_owner[index] == pid) {
+		sh->pmb_vaddr[index] = 0;
+		sh->pmb_size[index] = 0;
+	}
+	shared_unlock(sh);
+	__atomic_compare_exchange_n(&sh->pmb_owner[index], &pid, 0, 0,
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static int window_overlaps(unsigned long a, unsigned long a_len,
+	unsigned long b, unsigned long b_len)
+{
+	return a < b + b_len && b < a + a_len;
+}
+
+/* is [@base, @base + @size) free of other windows? */
+static int pmb_window_free(struct meram_shared *sh,
+	const struct meram_config *cfg, unsigned long base,
+	unsigned long size)
+{
+	int i;
+
+	for (i = 0; i < IPMMUI_PMB_COUNT; i++)
+		if (sh->pmb_size[i] && sh->pmb_owner[i] &&
+		    window_overlaps(base, size, sh->pmb_vaddr[i],
+				    sh->pmb_size[i]))
+			return 0;
+	/* windows handed out by tag in meram.conf */
+	for (i = 0; i < cfg->n_ipmmui; i++)
+		if (window_overlaps(base, size, cfg->ipmmui[i].vaddr,
+				    (unsigned long) cfg->ipmmui[i].size << 20))
+			return 0;
+	return 1;
+}
+
+/*
+ * Find a window of @size bytes, aligned to its size, between @start and
+ * @end for the PMB entry @index that the caller has claimed. Returns
+ * the start of the window or 0 if there is no room.
+ */
+unsigned long meram_shared_map_pmb(struct meram_shared *sh, int index,
+	unsigned long size, unsigned long start, unsigned long end)
+{
+	const struct meram_config *cfg = meram_config_get();
+	unsigned long base, found = 0;
+
+	shared_lock(sh);
+	if (sh->pmb_owner[index] == getpid()) {
+		for (base = start; start < end && end - base >= size;
+		     base += size) {
+			if (pmb_window_free(sh, cfg, base, size)) {
+				found = base;
+				break;
+			}
+		}
+	}
+	if (found) {
+		sh->pmb_vaddr[index] = found;
+		sh->pmb_size[index] = size;
+	}
+	shared_unlock(sh);
+	return found;
+}
@@ -0,0 +1,375 @@
+#include <meram/meram.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "meram_priv.h"
+
+/*
+ * Tracing of lock waits and holds, MERAM allocations and register
+ * accesses, built with --enable-trace.
+ *
+ * Every thread records into its own ring of the last
+ * MERAM_TRACE_RING_SIZE events, so recording takes no lock and only
+ * the owning thread ever writes to a ring. Rings are linked into a
+ * list on first use and stay there, so the events of threads that have
+ * exited can still be dumped. Once such a ring has been dumped it is
+ * handed to the next new thread. At most MERAM_TRACE_MAX_RINGS rings
+ * are allocated; beyond that, new threads take over rings of exited
+ * threads that were never dumped, or record nothing while all rings
+ * belong to live threads. Register accesses are recorded with
+ * the virtual address of the register and turned into the physical
+ * address when dumping, using the register windows of the process.
+ *
+ * Setting MERAM_TRACE to a file name dumps the trace when the process
+ * exits, in binary format if the name ends in ".bin" and as Chrome
+ * trace JSON otherwise.
+ */
+
+#ifdef MERAM_TRACE
+
+#define MERAM_TRACE_RING_SIZE	4096	/* events, a power of two */
+#define MERAM_TRACE_MAX_RINGS	64
+#define MERAM_TRACE_WINDOWS	4
+#define MERAM_TRACE_MAGIC	0x5254524d	/* "MRTR" */
+#define MERAM_TRACE_VERSION	1
+
+struct meram_trace_rec {
+	uint64_t ts;		/* ns, CLOCK_MONOTONIC */
+	uint64_t dur;		/* ns, 0 for register accesses */
+	uint64_t addr;		/* register address, or the event argument */
+	uint32_t val;
+	uint32_t event;
+};
+
+enum {
+	RING_LIVE,		/* owned by a running thread */
+	RING_EXITED,		/* its thread exited, events not dumped yet */
+	RING_FREE,		/* dumped, can be given to a new thread */
+};
+
+struct meram_trace_ring {
+	struct meram_trace_ring *next;
+	pid_t tid;
+	int state;
+	/* events before base belong to an earlier thread */
+	uint64_t base;
+	uint64_t head;
+	struct meram_trace_rec rec[MERAM_TRACE_RING_SIZE];
+};
+
+/* binary dump: a header, then per thread its tid, count and records */
+struct meram_trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t rec_size;
+	uint32_t pid;
+};
+
+static const char *event_names[] = {
+	[MERAM_TRACE_ICB_WAIT] = "icb_wait",
+	[MERAM_TRACE_ICB_HOLD] = "icb_hold",
+	[MERAM_TRACE_REG_WAIT] = "reg_wait",
+	[MERAM_TRACE_REG_HOLD] = "reg_hold",
+	[MERAM_TRACE_POOL_WAIT] = "pool_wait",
+	[MERAM_TRACE_ALLOC] = "alloc",
+	[MERAM_TRACE_FREE] = "free",
+	[MERAM_TRACE_MMIO_READ] = "mmio_read",
+	[MERAM_TRACE_MMIO_WRITE] = "mmio_write",
+};
+
+static struct meram_trace_ring *rings;
+static int n_rings;
+static __thread struct meram_trace_ring *ring;
+static pthread_key_t ring_key;
+
+static struct {
+	uintptr_t vaddr;
+	unsigned long len;
+	unsigned long paddr;
+} windows[MERAM_TRACE_WINDOWS];
+static int n_windows;
+static pthread_mutex_t window_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void meram_trace_atexit(void)
+{
+	const char *path = getenv("MERAM_TRACE");
+	size_t len = strlen(path);
+
+	meram_trace_dump(path, len > 4 && !strcmp(path + len - 4, ".bin") ?
+			 MERAM_TRACE_BINARY : MERAM_TRACE_CHROME);
+}
+
+/* thread exit, the ring is kept until its events have been dumped */
+static void meram_trace_thread_exit(void *p)
+{
+	struct meram_trace_ring *r = p;
+
+	ring = NULL;
+	__atomic_store_n(&r->state, RING_EXITED, __ATOMIC_RELEASE);
+}
+
+static void meram_trace_init(void)
+{
+	const char *path = getenv("MERAM_TRACE");
+
+	pthread_key_create(&ring_key, meram_trace_thread_exit);
+	if (path && *path)
+		atexit(meram_trace_atexit);
+}
+
+/* take over a ring in @state */
+static struct meram_trace_ring *ring_reuse(int state)
+{
+	struct meram_trace_ring *r;
+	int expected;
+
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		expected = state;
+		if (__atomic_compare_exchange_n(&r->state, &expected,
+				RING_LIVE, 0, __ATOMIC_ACQUIRE,
+				__ATOMIC_RELAXED)) {
+			__atomic_store_n(&r->base, r->head, __ATOMIC_RELEASE);
+			return r;
+		}
+	}
+	return NULL;
+}
+
+static struct meram_trace_ring *ring_alloc(void)
+{
+	struct meram_trace_ring *r;
+
+	if (__atomic_fetch_add(&n_rings, 1, __ATOMIC_RELAXED) >=
+	    MERAM_TRACE_MAX_RINGS)
+		goto full;
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		goto full;
+	r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	return r;
+full:
+	__atomic_fetch_sub(&n_rings, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static struct meram_trace_ring *meram_trace_ring(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	struct meram_trace_ring *r;
+
+	pthread_once(&once, meram_trace_init);
+	r = ring_reuse(RING_FREE);
+	if (!r)
+		r = ring_alloc();
+	if (!r)
+		r = ring_reuse(RING_EXITED);
+	if (!r)
+		return NULL;
+	r->tid = syscall(SYS_gettid);
+	pthread_setspecific(ring_key, r);
+	return r;
+}
+
+uint64_t meram_trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void meram_trace_record(int event, uint64_t start, uint64_t addr,
+	uint32_t val)
+{
+	struct meram_trace_rec *rec;
+	uint64_t now = meram_trace_now();
+
+	if (!ring && !(ring = meram_trace_ring()))
+		return;
+	rec = &ring->rec[ring->head & (MERAM_TRACE_RING_SIZE - 1)];
+	rec->ts = start ? start : now;
+	rec->dur = start ? now - start : 0;
+	rec->addr = addr;
+	rec->val = val;
+	rec->event = event;
+	/* publish the record to meram_trace_dump */
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+void meram_trace_window(void *vaddr, unsigned long len, unsigned long paddr)
+{
+	int i;
+
+	pthread_mutex_lock(&window_mutex);
+	for (i = 0; i < n_windows; i++)
+		if (windows[i].vaddr == (uintptr_t) vaddr)
+			break;
+	if (i < MERAM_TRACE_WINDOWS) {
+		windows[i].vaddr = (uintptr_t) vaddr;
+		windows[i].len = len;
+		windows[i].paddr = paddr;
+		if (i == n_windows)
+			n_windows++;
+	}
+	pthread_mutex_unlock(&window_mutex);
+}
+
+static int is_mmio(uint32_t event)
+{
+	return event == MERAM_TRACE_MMIO_READ ||
+		event == MERAM_TRACE_MMIO_WRITE;
+}
+
+/* physical address of a traced register, or its virtual address */
+static uint64_t mmio_paddr(uint64_t addr)
+{
+	int i;
+
+	for (i = 0; i < n_windows; i++)
+		if (addr >= windows[i].vaddr &&
+		    addr - windows[i].vaddr < windows[i].len)
+			return windows[i].paddr + (addr - windows[i].vaddr);
+	return addr;
+}
+
+/*
+ * Copy the events of @r that are still in the ring. Records the owner
+ * may have overwritten while they were being copied are dropped.
+ */
+static int ring_snapshot(struct meram_trace_ring *r,
+	struct meram_trace_rec *out)
+{
+	uint64_t base, head, first, end, valid, i;
+	int n;
+
+	base = __atomic_load_n(&r->base, __ATOMIC_ACQUIRE);
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	first = head > MERAM_TRACE_RING_SIZE ? head - MERAM_TRACE_RING_SIZE : 0;
+	if (first < base)
+		first = base;
+	for (i = first; i < head; i++)
+		out[i - first] = r->rec[i & (MERAM_TRACE_RING_SIZE - 1)];
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	end = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+	/* the slot of event i is reused once the owner starts on i + size */
+	valid = end + 1 > MERAM_TRACE_RING_SIZE ?
+		end + 1 - MERAM_TRACE_RING_SIZE : 0;
+	if (valid < first)
+		valid = first;
+	if (valid > head)
+		valid = head;
+	n = head - valid;
+	memmove(out, out + (valid - first), n * sizeof(*out));
+	for (i = 0; i < (uint64_t) n; i++)
+		if (is_mmio(out[i].event))
+			out[i].addr = mmio_paddr(out[i].addr);
+	return n;
+}
+
+static void dump_chrome(FILE *f, pid_t tid, struct meram_trace_rec *rec,
+	int n, int *first)
+{
+	const char *name;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		name = rec[i].event < sizeof(event_names) /
+			sizeof(event_names[0]) ? event_names[rec[i].event] : NULL;
+		if (!name)
+			continue;
+		fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"meram\","
+			"\"pid\":%d,\"tid\":%d,\"ts\":%.3f,",
+			*first ? "" : ",", name, (int) getpid(), (int) tid,
+			rec[i].ts / 1000.0);
+		*first = 0;
+		if (is_mmio(rec[i].event))
+			fprintf(f, "\"ph\":\"i\",\"s\":\"t\",\"args\":"
+				"{\"addr\":\"0x%llx\",\"val\":\"0x%08x\"}}",
+				(unsigned long long) rec[i].addr, rec[i].val);
+		else
+			fprintf(f, "\"ph\":\"X\",\"dur\":%.3f,\"args\":"
+				"{\"arg\":%llu,\"val\":%d}}",
+				rec[i].dur / 1000.0,
+				(unsigned long long) rec[i].addr,
+				(int) rec[i].val);
+	}
+}
+
+int meram_trace_dump(const char *path, int format)
+{
+	struct meram_trace_header hdr = {
+		MERAM_TRACE_MAGIC, MERAM_TRACE_VERSION,
+		sizeof(struct meram_trace_rec), getpid()
+	};
+	struct meram_trace_rec *rec;
+	struct meram_trace_ring *r;
+	int n, state, first = 1, ret = 0;
+	uint32_t tid_count[2];
+	FILE *f;
+
+	if (!path || (format != MERAM_TRACE_CHROME &&
+		      format != MERAM_TRACE_BINARY))
+		return -1;
+	rec = malloc(MERAM_TRACE_RING_SIZE * sizeof(*rec));
+	if (!rec)
+		return -1;
+	f = fopen(path, "w");
+	if (!f) {
+		free(rec);
+		return -1;
+	}
+
+	pthread_mutex_lock(&window_mutex);
+	if (format == MERAM_TRACE_CHROME)
+		fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	else
+		fwrite(&hdr, sizeof(hdr), 1, f);
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		state = __atomic_load_n(&r->state, __ATOMIC_ACQUIRE);
+		if (state == RING_FREE)
+			continue;
+		n = ring_snapshot(r, rec);
+		if (format == MERAM_TRACE_CHROME) {
+			dump_chrome(f, r->tid, rec, n, &first);
+		} else {
+			tid_count[0] = r->tid;
+			tid_count[1] = n;
+			fwrite(tid_count, sizeof(tid_count), 1, f);
+			fwrite(rec, sizeof(*rec), n, f);
+		}
+		/* the events of an exited thread are out, reuse its ring */
+		if (state == RING_EXITED)
+			__atomic_compare_exchange_n(&r->state, &state,
+				RING_FREE, 0, __ATOMIC_RELEASE,
+				__ATOMIC_RELAXED);
+	}
+	if (format == MERAM_TRACE_CHROME)
+		fprintf(f, "\n]}\n");
+	pthread_mutex_unlock(&window_mutex);
+
+	if (ferror(f))
+		ret = -1;
+	if (fclose(f))
+		ret = -1;
+	free(rec);
+	return ret;
+}
+
+#else
+
+int meram_trace_dump(const char *path, int format)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif
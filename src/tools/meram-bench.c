@@ -0,0 +1,574 @@
+/*
+ * meram-bench: micro benchmarks for libshmeram
+ *
+ * Most useful when the library is built with --enable-simulator, so
+ * that the numbers reflect the library itself rather than the bus.
+ * The tags benchmark loads a generated meram.conf through MERAM_CONF in
+ * a child process, which then keeps its MERAM state to itself.
+ */
+#include <meram/meram.h>
+#include <meram/ipmmui.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define MAX_LIVE	64
+#define N_TAGS		300
+
+struct latency {
+	long *ns;
+	int count;
+};
+
+struct bench_opts {
+	int iterations;
+	int threads;
+	unsigned int seed;
+};
+
+static long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+	long x = *(const long *) a, y = *(const long *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void latency_init(struct latency *lat, int size)
+{
+	lat->ns = calloc(size, sizeof(long));
+	lat->count = 0;
+}
+
+static void latency_add(struct latency *lat, long ns)
+{
+	lat->ns[lat->count++] = ns;
+}
+
+static void latency_report(const char *name, struct latency *lat)
+{
+	long sum = 0;
+	int i;
+
+	if (!lat->count) {
+		printf("  %-8s no samples\n", name);
+		return;
+	}
+	qsort(lat->ns, lat->count, sizeof(long), cmp_long);
+	for (i = 0; i < lat->count; i++)
+		sum += lat->ns[i];
+	printf("  %-8s n=%-8d mean=%ldns p50=%ldns p99=%ldns max=%ldns\n",
+	       name, lat->count, sum / lat->count,
+	       lat->ns[lat->count / 2], lat->ns[lat->count * 99 / 100],
+	       lat->ns[lat->count - 1]);
+}
+
+static void latency_free(struct latency *lat)
+{
+	free(lat->ns);
+}
+
+/* size distribution loosely modelled on ICB line buffers */
+static int random_size(void)
+{
+	int r = rand() % 100;
+
+	if (r < 70)
+		return 1 + rand() % 32;
+	if (r < 95)
+		return 33 + rand() % 96;
+	return 129 + rand() % 256;
+}
+
+static int bench_alloc(MERAM *meram, struct bench_opts *opts)
+{
+	struct { int offset, size; } live[MAX_LIVE];
+	struct latency alloc_lat, free_lat;
+	struct meram_stats st;
+	int n_live = 0, failures = 0, samples = 0, i;
+	double frag_sum = 0, frag_max = 0;
+
+	latency_init(&alloc_lat, opts->iterations);
+	latency_init(&free_lat, opts->iterations);
+
+	for (i = 0; i < opts->iterations; i++) {
+		long t;
+
+		if (n_live == 0 || (n_live < MAX_LIVE && (rand() & 1))) {
+			int size = random_size();
+			int off;
+
+			t = now_ns();
+			off = meram_alloc_memory_block(meram, size);
+			latency_add(&alloc_lat, now_ns() - t);
+			if (off < 0) {
+				failures++;
+				continue;
+			}
+			live[n_live].offset = off;
+			live[n_live].size = size;
+			n_live++;
+		} else {
+			int victim = rand() % n_live;
+
+			t = now_ns();
+			meram_free_memory_block(meram, live[victim].offset,
+						live[victim].size);
+			latency_add(&free_lat, now_ns() - t);
+			live[victim] = live[--n_live];
+		}
+
+		if ((i + 1) % (opts->iterations / 16 + 1) == 0) {
+			double frag;
+
+			meram_get_stats(meram, &st);
+			frag = st.free_blocks ?
+				1.0 - (double) st.largest_free / st.free_blocks : 0;
+			frag_sum += frag;
+			if (frag > frag_max)
+				frag_max = frag;
+			samples++;
+		}
+	}
+
+	for (i = 0; i < n_live; i++)
+		meram_free_memory_block(meram, live[i].offset, live[i].size);
+
+	printf("alloc: %d operations, %d allocation failures\n",
+	       opts->iterations, failures);
+	latency_report("alloc", &alloc_lat);
+	latency_report("free", &free_lat);
+	printf("  fragmentation (1 - largest/free): mean=%.3f max=%.3f\n",
+	       samples ? frag_sum / samples : 0, frag_max);
+	if (meram_get_stats(meram, &st) == 0 && st.allocs + st.failures)
+		printf("  library: %lu allocs, %lu failures, mean=%luns "
+		       "max=%luns\n", st.allocs, st.failures,
+		       st.alloc_ns_total / (st.allocs + st.failures),
+		       st.alloc_ns_max);
+
+	latency_free(&alloc_lat);
+	latency_free(&free_lat);
+	return 0;
+}
+
+struct icb_thread {
+	pthread_t thread;
+	MERAM *meram;
+	int iterations;
+	int first, count;
+	unsigned int seed;
+	struct latency lat;
+};
+
+static void *icb_thread_run(void *arg)
+{
+	struct icb_thread *t = arg;
+	int i;
+
+	for (i = 0; i < t->iterations; i++) {
+		int index = t->first + rand_r(&t->seed) % t->count;
+		long start = now_ns();
+		ICB *icb = meram_lock_icb(t->meram, index);
+
+		latency_add(&t->lat, now_ns() - start);
+		meram_unlock_icb(t->meram, icb);
+	}
+	return NULL;
+}
+
+/*
+ * Lock/unlock ICBs from several threads, either each thread on its own
+ * ICB or all threads over a small shared set of ICBs.
+ */
+static int icb_contention(MERAM *meram, struct bench_opts *opts,
+	const char *name, int overlap)
+{
+	struct icb_thread *threads;
+	struct latency all;
+	int per_thread = opts->iterations / opts->threads;
+	long start, elapsed;
+	int i, j;
+
+	threads = calloc(opts->threads, sizeof(*threads));
+	latency_init(&all, per_thread * opts->threads);
+	for (i = 0; i < opts->threads; i++) {
+		struct icb_thread *t = &threads[i];
+
+		t->meram = meram;
+		t->iterations = per_thread;
+		t->first = overlap ? 32 : 32 + i;
+		t->count = overlap ? 4 : 1;
+		t->seed = opts->seed + i;
+		latency_init(&t->lat, per_thread);
+	}
+
+	start = now_ns();
+	for (i = 0; i < opts->threads; i++)
+		pthread_create(&threads[i].thread, NULL, icb_thread_run,
+			       &threads[i]);
+	for (i = 0; i < opts->threads; i++)
+		pthread_join(threads[i].thread, NULL);
+	elapsed = now_ns() - start;
+
+	for (i = 0; i < opts->threads; i++) {
+		for (j = 0; j < threads[i].lat.count; j++)
+			latency_add(&all, threads[i].lat.ns[j]);
+		latency_free(&threads[i].lat);
+	}
+	printf("icb %s: %d threads, %d lock/unlock pairs, %.0f pairs/s\n",
+	       name, opts->threads, all.count,
+	       all.count / (elapsed / 1e9));
+	latency_report("lock", &all);
+
+	latency_free(&all);
+	free(threads);
+	return 0;
+}
+
+static int bench_icb(MERAM *meram, struct bench_opts *opts)
+{
+	if (opts->threads < 1 || opts->threads > MAX_ICB_INDEX - 32 + 1) {
+		fprintf(stderr, "icb: thread count must be 1 to %d\n",
+			MAX_ICB_INDEX - 32 + 1);
+		return -1;
+	}
+	return icb_contention(meram, opts, "disjoint", 0) |
+		icb_contention(meram, opts, "overlap", 1);
+}
+
+/* fraction of a fixed set of large requests that can be satisfied */
+static double large_alloc_rate(MERAM *meram)
+{
+	static const int sizes[] = { 32, 48, 64, 96, 128, 192, 256, 384 };
+	int i, ok = 0;
+
+	for (i = 0; i < 8; i++) {
+		int off = meram_alloc_memory_block(meram, sizes[i]);
+
+		if (off >= 0) {
+			meram_free_memory_block(meram, off, sizes[i]);
+			ok++;
+		}
+	}
+	return ok / 8.0;
+}
+
+/*
+ * Fragment MERAM with ICB buffers of mixed sizes, release a random half
+ * of them and compare how many large allocations succeed before and
+ * after compacting the ones still in use.
+ */
+static int bench_compact(MERAM *meram, struct bench_opts *opts)
+{
+	ICB *icbs[MAX_ICB_INDEX + 1];
+	int rounds = opts->iterations / 10000 + 1;
+	double before = 0, after = 0;
+	long t, compact_ns = 0;
+	int moved = 0, r, i, n;
+
+	for (r = 0; r < rounds; r++) {
+		n = 0;
+		for (i = 32; i <= MAX_ICB_INDEX; i++) {
+			ICB *icb = meram_trylock_icb(meram, i);
+
+			if (!icb)
+				continue;
+			if (meram_alloc_icb_memory(meram, icb,
+						   random_size() / 4 + 1) < 0) {
+				meram_unlock_icb(meram, icb);
+				break;
+			}
+			icbs[n++] = icb;
+		}
+		for (i = 0; i < n; ) {
+			if (rand() & 1) {
+				meram_unlock_icb(meram, icbs[i]);
+				icbs[i] = icbs[--n];
+			} else {
+				i++;
+			}
+		}
+
+		before += large_alloc_rate(meram);
+		t = now_ns();
+		moved += meram_compact_icbs(meram, icbs, n);
+		compact_ns += now_ns() - t;
+		after += large_alloc_rate(meram);
+
+		for (i = 0; i < n; i++)
+			meram_unlock_icb(meram, icbs[i]);
+	}
+
+	printf("compact: %d rounds, %d ICBs moved, %.0fus per compaction\n",
+	       rounds, moved, compact_ns / 1e3 / rounds);
+	printf("  large allocation success: before=%.1f%% after=%.1f%%\n",
+	       100 * before / rounds, 100 * after / rounds);
+	return 0;
+}
+
+/* clear, pattern fill and copy a large range of MERAM blocks */
+static int bench_fill(MERAM *meram, struct bench_opts *opts)
+{
+	static const struct {
+		const char *name;
+		int bits;
+		unsigned long long pattern;
+	} fills[] = {
+		{ "fill8", 8, 0x80 },
+		{ "fill32", 32, 0x80108010 },
+		{ "fill64", 64, 0x0123456789abcdefULL },
+	};
+	int blocks = 512, rounds = opts->iterations / 1000 + 1;
+	size_t bytes = (size_t) blocks << 10;
+	char *buf;
+	long t;
+	int off, i, j;
+
+	off = meram_alloc_memory_block(meram, blocks);
+	buf = malloc(bytes);
+	if (off < 0 || !buf) {
+		fprintf(stderr, "fill: cannot allocate %d blocks\n", blocks);
+		free(buf);
+		return -1;
+	}
+	memset(buf, 0x5a, bytes);
+
+	printf("fill: %d rounds over %d KB\n", rounds, blocks);
+	for (j = 0; j < 3; j++) {
+		t = now_ns();
+		for (i = 0; i < rounds; i++)
+			meram_fill_memory_pattern(meram, off, blocks,
+				fills[j].pattern, fills[j].bits);
+		t = now_ns() - t;
+		printf("  %-8s %.2f GB/s\n", fills[j].name,
+		       (double) bytes * rounds / t);
+	}
+	t = now_ns();
+	for (i = 0; i < rounds; i++)
+		meram_copy_to_memory_block(meram, off, buf, bytes);
+	t = now_ns() - t;
+	printf("  %-8s %.2f GB/s\n", "copy-in", (double) bytes * rounds / t);
+	t = now_ns();
+	for (i = 0; i < rounds; i++)
+		meram_copy_from_memory_block(meram, off, buf, bytes);
+	t = now_ns() - t;
+	printf("  %-8s %.2f GB/s\n", "copy-out", (double) bytes * rounds / t);
+
+	meram_free_memory_block(meram, off, blocks);
+	free(buf);
+	return 0;
+}
+
+static char tags_conf[] = "/tmp/meram-bench-XXXXXX";
+static char tag_names[N_TAGS][16];
+
+/* write a meram.conf with N_TAGS ipmmui tags and point MERAM_CONF at it */
+static int tags_setup(void)
+{
+	FILE *f;
+	int fd, i;
+
+	fd = mkstemp(tags_conf);
+	if (fd < 0 || !(f = fdopen(fd, "w"))) {
+		perror(tags_conf);
+		return -1;
+	}
+	for (i = 0; i < N_TAGS; i++) {
+		snprintf(tag_names[i], sizeof(tag_names[i]), "codec%03d.%d",
+			 i, i % 7);
+		fprintf(f, "ipmmui %s 0x%08x 16\n", tag_names[i],
+			0x80000000U + (i << 24));
+	}
+	fclose(f);
+	return setenv("MERAM_CONF", tags_conf, 1);
+}
+
+/* the list walk ipmmui_get_vaddr used to do, for comparison */
+static int tags_linear(const char *tag)
+{
+	int i;
+
+	for (i = 0; i < N_TAGS; i++)
+		if (!strcmp(tag_names[i], tag))
+			return i;
+	return -1;
+}
+
+static int bench_tags(struct bench_opts *opts)
+{
+	static const char *names[] = { "linear", "string", "handle" };
+	int handles[N_TAGS], found[3] = { 0 }, *order;
+	unsigned long vaddr;
+	IPMMUI *ipmmui;
+	int i, j, size;
+	long t;
+
+	ipmmui = ipmmui_open();
+	order = malloc(opts->iterations * sizeof(int));
+	if (!ipmmui || !order) {
+		fprintf(stderr, "tags: cannot open IPMMUI\n");
+		free(order);
+		ipmmui_close(ipmmui);
+		return -1;
+	}
+	for (i = 0; i < N_TAGS; i++)
+		handles[i] = ipmmui_get_tag(ipmmui, tag_names[i]);
+	for (i = 0; i < opts->iterations; i++)
+		order[i] = rand() % N_TAGS;
+
+	printf("tags: %d lookups over %d tags\n", opts->iterations, N_TAGS);
+	for (j = 0; j < 3; j++) {
+		t = now_ns();
+		for (i = 0; i < opts->iterations; i++) {
+			const char *tag = tag_names[order[i]];
+
+			if (j == 0)
+				found[j] += tags_linear(tag) >= 0;
+			else if (j == 1)
+				found[j] += ipmmui_get_vaddr(ipmmui, tag,
+							     &vaddr, &size) == 0;
+			else
+				found[j] += ipmmui_get_tag_vaddr(ipmmui,
+					handles[order[i]], &vaddr, &size) == 0;
+		}
+		t = now_ns() - t;
+		printf("  %-8s %.1f ns/lookup, %d found\n", names[j],
+		       (double) t / opts->iterations, found[j]);
+	}
+
+	free(order);
+	ipmmui_close(ipmmui);
+	return found[1] == opts->iterations ? 0 : -1;
+}
+
+/*
+ * The configuration is loaded once per process, so the tags benchmark
+ * runs in a child forked before this process uses the library.
+ */
+static int bench_tags_child(struct bench_opts *opts)
+{
+	int status, ret;
+	pid_t pid;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (pid == 0) {
+		srand(opts->seed);
+		ret = tags_setup();
+		if (ret == 0)
+			ret = bench_tags(opts);
+		unlink(tags_conf);
+		fflush(stdout);
+		_exit(ret ? 1 : 0);
+	}
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status))
+		return -1;
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	int (*run)(MERAM *meram, struct bench_opts *opts);
+	const char *help;
+} benches[] = {
+	{ "alloc", bench_alloc,
+	  "random MERAM block alloc/free trace, latency and fragmentation" },
+	{ "icb", bench_icb,
+	  "ICB lock/unlock from many threads, disjoint and overlapping ICBs" },
+	{ "compact", bench_compact,
+	  "fragment MERAM with ICB buffers, large allocations vs compaction" },
+	{ "fill", bench_fill,
+	  "MERAM pattern fill and copy-in/copy-out bandwidth" },
+	/* run first, see bench_tags_child */
+	{ "tags", NULL,
+	  "ipmmui_get_vaddr lookups over a generated 300 tag meram.conf" },
+	{ NULL, NULL, NULL }
+};
+
+static void usage(const char *prog)
+{
+	int i;
+
+	printf("Usage: %s [-n iterations] [-t threads] [-s seed] [bench...]\n",
+	       prog);
+	printf("Benchmarks:\n");
+	for (i = 0; benches[i].name; i++)
+		printf("  %-10s %s\n", benches[i].name, benches[i].help);
+}
+
+/* all benchmarks run when none are named */
+static int bench_selected(int argc, char *argv[], const char *name)
+{
+	int i;
+
+	if (optind == argc)
+		return 1;
+	for (i = optind; i < argc; i++)
+		if (!strcmp(argv[i], name))
+			return 1;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_opts opts = { 100000, 16, 1 };
+	MERAM *meram;
+	int opt, i, j, ret = 0;
+
+	while ((opt = getopt(argc, argv, "n:t:s:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			opts.iterations = atoi(optarg);
+			break;
+		case 't':
+			opts.threads = atoi(optarg);
+			break;
+		case 's':
+			opts.seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (opts.iterations <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (bench_selected(argc, argv, "tags"))
+		ret |= bench_tags_child(&opts);
+
+	meram = meram_open();
+	if (!meram) {
+		fprintf(stderr, "meram_open failed\n");
+		return 1;
+	}
+
+	for (j = 0; benches[j].name; j++) {
+		if (!benches[j].run ||
+		    !bench_selected(argc, argv, benches[j].name))
+			continue;
+		srand(opts.seed);
+		ret |= benches[j].run(meram, &opts);
+	}
+
+	meram_close(meram);
+	return ret ? 1 : 0;
+}
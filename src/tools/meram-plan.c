@@ -0,0 +1,158 @@
+/*
+ * meram-plan: plan the ICB and MERAM use of a set of concurrent streams
+ *
+ * Each stream is given as WIDTHxHEIGHT:FORMAT:MODE[:PRIORITY[:MIN[:MAX]]],
+ * e.g. 1920x1080:nv12:w:2:8:32 for a decoder output, either on the
+ * command line or one per line in a file (-f). Built with
+ * --enable-simulator this can be run on any host to try out a pipeline.
+ */
+#include <meram/meram.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_STREAMS	64
+
+static const struct {
+	const char *name;
+	int n_planes;
+	int format[MERAM_MAX_PLANES];
+} formats[] = {
+	{ "nv12", 2, { MERAM_PF_Y8, MERAM_PF_CBCR420 } },
+	{ "nv16", 2, { MERAM_PF_Y8, MERAM_PF_CBCR422 } },
+	{ "y8", 1, { MERAM_PF_Y8 } },
+	{ "rgb565", 1, { MERAM_PF_RGB565 } },
+	{ "rgb888", 1, { MERAM_PF_RGB888 } },
+	{ "rgbx8888", 1, { MERAM_PF_RGBX8888 } },
+	{ NULL, 0, { 0 } }
+};
+
+static int parse_stream(const char *spec, struct meram_plan_stream *st,
+	char *name, size_t name_len)
+{
+	char fmt[16], mode;
+	int width, height, i, n;
+
+	memset(st, 0, sizeof(*st));
+	n = sscanf(spec, "%dx%d:%15[^:]:%c:%d:%d:%d", &width, &height, fmt,
+		   &mode, &st->priority, &st->min_lines, &st->max_lines);
+	if (n < 4 || (mode != 'r' && mode != 'w'))
+		return -1;
+	for (i = 0; formats[i].name; i++)
+		if (!strcmp(formats[i].name, fmt))
+			break;
+	if (!formats[i].name)
+		return -1;
+
+	st->n_planes = formats[i].n_planes;
+	for (n = 0; n < st->n_planes; n++) {
+		st->planes[n].width = width;
+		st->planes[n].height = height;
+		st->planes[n].format = formats[i].format[n];
+		st->planes[n].mode = mode == 'r' ?
+			MERAM_ICB_READ : MERAM_ICB_WRITE;
+	}
+	snprintf(name, name_len, "%s", spec);
+	name[strcspn(name, "\n")] = '\0';
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	int i;
+
+	printf("Usage: %s [-f file] [stream...]\n", prog);
+	printf("  stream: WIDTHxHEIGHT:FORMAT:MODE[:PRIORITY[:MIN[:MAX]]]\n");
+	printf("  FORMAT:");
+	for (i = 0; formats[i].name; i++)
+		printf(" %s", formats[i].name);
+	printf("\n  MODE: r (read through MERAM) or w (write through MERAM)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static struct meram_plan_stream streams[MAX_STREAMS];
+	static char names[MAX_STREAMS][64];
+	struct meram_stats stats;
+	const char *file = NULL;
+	char line[256];
+	MERAM *meram;
+	int opt, n = 0, i, j, used = 0, ret;
+
+	while ((opt = getopt(argc, argv, "f:h")) != -1) {
+		switch (opt) {
+		case 'f':
+			file = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (file) {
+		FILE *f = strcmp(file, "-") ? fopen(file, "r") : stdin;
+
+		if (!f) {
+			perror(file);
+			return 1;
+		}
+		while (fgets(line, sizeof(line), f) && n < MAX_STREAMS) {
+			if (line[0] == '#' || line[0] == '\n')
+				continue;
+			if (parse_stream(line, &streams[n], names[n],
+					 sizeof(names[n])) < 0) {
+				fprintf(stderr, "invalid stream: %s", line);
+				return 1;
+			}
+			n++;
+		}
+		if (f != stdin)
+			fclose(f);
+	}
+	for (i = optind; i < argc && n < MAX_STREAMS; i++, n++) {
+		if (parse_stream(argv[i], &streams[n], names[n],
+				 sizeof(names[n])) < 0) {
+			fprintf(stderr, "invalid stream: %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if (!n) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	meram = meram_open();
+	if (!meram) {
+		fprintf(stderr, "meram_open failed\n");
+		return 1;
+	}
+	meram_get_stats(meram, &stats);
+	printf("MERAM: %d blocks, %d free (largest run %d), %d reserved\n",
+	       stats.total_blocks, stats.free_blocks, stats.largest_free,
+	       stats.reserved_blocks);
+
+	ret = meram_plan(meram, streams, n);
+	if (ret < 0) {
+		printf("the streams do not fit, even with their minimum "
+		       "number of lines\n");
+		meram_close(meram);
+		return 2;
+	}
+
+	printf("%-32s %5s %6s %6s  %s\n", "stream", "lines", "block",
+	       "size", "ICBs");
+	for (i = 0; i < n; i++) {
+		printf("%-32s %5d %6d %6d ", names[i], streams[i].lines,
+		       streams[i].block, streams[i].layout.size);
+		for (j = 0; j < streams[i].n_planes; j++)
+			printf(" %d", streams[i].icb[j]);
+		printf("\n");
+		used += streams[i].layout.size;
+	}
+	printf("total: %d of %d free blocks\n", used, stats.free_blocks);
+
+	meram_close(meram);
+	return 0;
+}